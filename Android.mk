@@ -27,7 +27,10 @@ include $(CLEAR_VARS)
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware
 LOCAL_CFLAGS := -O2 -fpermissive -Wmissing-field-initializers
-LOCAL_SRC_FILES := gps_goby.cpp
+LOCAL_SRC_FILES := gps_goby.cpp \
+                   gps_geofence.cpp \
+                   gps_trace.cpp \
+                   gps_clock.cpp
 LOCAL_MODULE := gps.goby
 LOCAL_MODULE_TAGS := debug
 
@@ -35,7 +38,15 @@ include $(BUILD_SHARED_LIBRARY)
 #############################################
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := local_gps.cpp
+LOCAL_SRC_FILES := local_gps.cpp \
+                   gps_capture.cpp \
+                   gps_noise.cpp \
+                   gps_realtime.cpp \
+                   gps_log.cpp \
+                   gps_property.cpp \
+                   gps_trace.cpp \
+                   gps_shm.cpp \
+                   gps_clock.cpp
 LOCAL_PBUF_INTERMEDIATES := $(call intermediates-dir-for,SHARED_LIBRARIES,libcppsensors_packet,,)/proto/external/aic/libaicd/
 
 LOCAL_C_INCLUDES	:= bionic \
@@ -53,3 +64,59 @@ LOCAL_STATIC_LIBRARIES += libprotobuf-cpp-2.3.0-lite libprotobuf-cpp-2.3.0-full
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_EXECUTABLE)
+#############################################
+# Stand-in producer of the sample ring of aic.gps.shm
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := gps_shm_feed.cpp \
+                   gps_shm.cpp
+LOCAL_CFLAGS := -O2 -fpermissive -Wmissing-field-initializers
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_MODULE := gps_shm_feed
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+#############################################
+# Driver of the virtual clock of aic.gps.clock
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := gps_clock_drive.cpp
+LOCAL_CFLAGS := -O2 -fpermissive -Wmissing-field-initializers
+LOCAL_MODULE := gps_clock_drive
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+#############################################
+# Offline statistics of NMEA logs, with the parser of the HAL
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := gps_nmea_stats.cpp \
+                   gps_goby.cpp \
+                   gps_geofence.cpp \
+                   gps_trace.cpp \
+                   gps_clock.cpp
+LOCAL_C_INCLUDES := hardware/libhardware/include
+LOCAL_CFLAGS := -O2 -fpermissive -Wmissing-field-initializers
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lm
+LOCAL_MODULE := gps_nmea_stats
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+#############################################
+# Geofences with the session stopped, against a stand-in local_gps
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := gps_geofence_test.cpp \
+                   gps_goby.cpp \
+                   gps_geofence.cpp \
+                   gps_trace.cpp \
+                   gps_clock.cpp
+LOCAL_C_INCLUDES := hardware/libhardware/include
+LOCAL_CFLAGS := -O2 -fpermissive -Wmissing-field-initializers
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lm
+LOCAL_MODULE := gps_geofence_test
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -1,9 +1,89 @@
 #ifndef GPS_H_
 #define GPS_H_
 
+#include <stdint.h>
+#include <string.h>
+
 #define GPS_DEBUG 0
 #define GPS_PORT  22470
 #define SIM_GPS_PORT  22475
 
+/* fixed point coordinates: nano-degrees */
+#define GPS_COORD_SCALE  1000000000LL
+
+/* metres per degree of latitude, on a spherical earth of 6371 km. users
+ * include <math.h> */
+#define GPS_METERS_PER_DEG  (6371000. * M_PI / 180.)
+
+/* abstract unix socket (SOCK_SEQPACKET) between local_gps and the HAL,
+ * each message holds complete NMEA sentences. TCP on GPS_PORT stays
+ * available, e.g. for remote debugging */
+#define GPS_SOCKET_NAME  "aic_gps"
+#define GPS_MAX_MESSAGE_SIZE  1024
+
+/* session commands sent by the HAL to local_gps, one byte each. fixes
+ * are only emitted while a session is started. clients that never send
+ * any command (e.g. debugging tools on TCP) always get them */
+#define GPS_SESSION_START  'S'
+#define GPS_SESSION_STOP   'P'
+
+/* transport used by the HAL: GPS_TRANSPORT_LOCAL (default) or GPS_TRANSPORT_TCP */
+#define GPS_TRANSPORT_PROPERTY  "aic.gps.transport"
+#define GPS_TRANSPORT_LOCAL  "local"
+#define GPS_TRANSPORT_TCP    "tcp"
+
+/* fixes queued for the framework while its callback is busy:
+ * GPS_DELIVERY_LATEST (default) only delivers the newest, GPS_DELIVERY_ALL
+ * delivers every one of them */
+#define GPS_DELIVERY_PROPERTY  "aic.gps.delivery"
+#define GPS_DELIVERY_LATEST  "latest"
+#define GPS_DELIVERY_ALL     "all"
+
+/* checking of the NMEA checksums by the HAL: GPS_CHECKSUM_STRICT (default)
+ * rejects sentences with a wrong or missing checksum, GPS_CHECKSUM_IGNORE
+ * accepts them all, for sources with broken checksums */
+#define GPS_CHECKSUM_PROPERTY  "aic.gps.checksum"
+#define GPS_CHECKSUM_STRICT  "strict"
+#define GPS_CHECKSUM_IGNORE  "ignore"
+
+/* suppression of the location callbacks for a device that does not move:
+ * "<metres>[,<seconds>]". a fix is not delivered when it moved less than
+ * the distance from the last one delivered, with the same accuracy,
+ * bearing and speed, unless the keep-alive interval elapsed. empty or
+ * "0" (default) delivers every fix */
+#define GPS_SUPPRESS_PROPERTY           "aic.gps.suppress"
+#define GPS_SUPPRESS_DEFAULT_KEEPALIVE  30
+
+/* fix pipeline trace events, see gps_trace.hpp: "1" enables them. the
+ * sequence number of the fix goes ahead of the sentences of an epoch in
+ * a proprietary "$PAICT,<seq>" sentence, ignored by NMEA parsers */
+#define GPS_TRACE_PROPERTY  "aic.gps.trace"
+#define GPS_TRACE_SENTENCE  "$PAICT"
+
+/* path of a virtual clock driven by a test, see gps_clock.hpp. empty
+ * (default) for the system clocks */
+#define GPS_CLOCK_PROPERTY  "aic.gps.clock"
+
+/* XOR of the bytes between '$' and '*', eight at a time: XOR is bytewise,
+ * so the lanes of the word are folded together at the end */
+static inline unsigned nmea_checksum(const char *p, const char *end)
+{
+    uint64_t acc = 0, w;
+    unsigned sum;
+
+    for (; end - p >= 8; p += 8) {
+        memcpy(&w, p, sizeof(w));
+        acc ^= w;
+    }
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+
+    sum = (unsigned)(acc & 0xff);
+    for (; p < end; p++)
+        sum ^= (unsigned char)*p;
+    return sum;
+}
+
 
 #endif
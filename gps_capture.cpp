@@ -0,0 +1,244 @@
+#define LOG_TAG "local_gps"
+#include <cutils/log.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gps_capture.hpp"
+#include "gps_clock.hpp"
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+
+    while (len > 0) {
+        ssize_t ret = write(fd, p, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void capture_flush(gps_capture *cap) {
+    if (cap->count == 0)
+        return;
+
+    if (write_all(cap->fd, cap->batch, cap->count * sizeof(capture_record)) < 0)
+        SLOGE("GPS:: Capture write failed, errno=%d", errno);
+    cap->count = 0;
+}
+
+static capture_record *capture_next(gps_capture *cap, uint32_t type, uint64_t time_ns) {
+    capture_record *rec = &cap->batch[cap->count++];
+
+    memset(rec, 0, sizeof(*rec));
+    rec->type = type;
+    rec->seq = cap->seq++;
+    rec->time_ns = time_ns;
+    return rec;
+}
+
+static int capture_header_valid(const capture_header *hdr) {
+    return memcmp(hdr->magic, CAPTURE_MAGIC, sizeof(hdr->magic)) == 0 &&
+           hdr->version == CAPTURE_VERSION &&
+           hdr->record_size == CAPTURE_RECORD_SIZE &&
+           hdr->index_interval == CAPTURE_INDEX_INTERVAL;
+}
+
+int capture_open(gps_capture *cap, const char *path) {
+    capture_header hdr;
+    struct stat st;
+
+    cap->count = 0;
+    cap->seq = 0;
+
+    if ((cap->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0640)) < 0) {
+        SLOGE("GPS:: Unable to open capture %s, errno=%d", path, errno);
+        return -1;
+    }
+
+    if (fstat(cap->fd, &st) < 0)
+        goto fail;
+
+    // Never append records to a file of another format
+    if (st.st_size > 0 && (st.st_size < (off_t)sizeof(hdr) ||
+                           pread(cap->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+                           !capture_header_valid(&hdr))) {
+        char old[PATH_MAX];
+
+        snprintf(old, sizeof(old), "%s.old", path);
+        close(cap->fd);
+        if (rename(path, old) < 0 ||
+            (cap->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0640)) < 0) {
+            SLOGE("GPS:: Unable to move away capture %s, errno=%d", path, errno);
+            cap->fd = -1;
+            return -1;
+        }
+        SLOGW("GPS:: %s is not a capture of version %d, moved to %s", path, CAPTURE_VERSION, old);
+        st.st_size = 0;
+    }
+
+    if (st.st_size < (off_t)sizeof(hdr)) {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+        hdr.version = CAPTURE_VERSION;
+        hdr.record_size = CAPTURE_RECORD_SIZE;
+        hdr.index_interval = CAPTURE_INDEX_INTERVAL;
+        hdr.start_realtime_ns = gps_clock_ns(CLOCK_REALTIME);
+        if (ftruncate(cap->fd, 0) < 0 || write_all(cap->fd, &hdr, sizeof(hdr)) < 0)
+            goto fail;
+    } else {
+        // Appending to a previous capture, drop a partially written record
+        off_t records = (st.st_size - sizeof(hdr)) / CAPTURE_RECORD_SIZE;
+        if (ftruncate(cap->fd, sizeof(hdr) + records * CAPTURE_RECORD_SIZE) < 0)
+            goto fail;
+        cap->seq = records;
+    }
+
+    SLOGI("GPS:: Capturing simulator traffic to %s", path);
+    return 0;
+
+fail:
+    SLOGE("GPS:: Unable to prepare capture %s, errno=%d", path, errno);
+    close(cap->fd);
+    cap->fd = -1;
+    return -1;
+}
+
+void capture_fix(gps_capture *cap, const gps_fix *fix, uint64_t time_ns) {
+    capture_record *rec;
+
+    if (cap->fd < 0)
+        return;
+
+    rec = capture_next(cap, CAPTURE_RECORD_FIX, time_ns);
+    rec->u.fix.enabled = fix->enabled;
+    rec->u.fix.latitude = fix->latitude;
+    rec->u.fix.longitude = fix->longitude;
+    rec->u.fix.altitude = fix->altitude;
+    rec->u.fix.bearing = fix->bearing;
+    rec->u.fix.time_ms = fix->time_ms;
+
+    if ((cap->seq + 1) % CAPTURE_INDEX_INTERVAL == 0) {
+        rec = capture_next(cap, CAPTURE_RECORD_INDEX, time_ns);
+        rec->u.index.realtime_ns = gps_clock_ns(CLOCK_REALTIME);
+        rec->u.index.count = rec->seq;
+    }
+
+    if (cap->count >= CAPTURE_INDEX_INTERVAL - 1 ||
+        time_ns - cap->batch[0].time_ns >= CAPTURE_FLUSH_DELAY_NS)
+        capture_flush(cap);
+}
+
+int capture_timeout_ms(const gps_capture *cap, uint64_t time_ns) {
+    uint64_t age;
+
+    if (cap->fd < 0 || cap->count == 0)
+        return -1;
+    age = time_ns - cap->batch[0].time_ns;
+    if (age >= CAPTURE_FLUSH_DELAY_NS)
+        return 0;
+    return (int)((CAPTURE_FLUSH_DELAY_NS - age + 999999) / 1000000);
+}
+
+void capture_tick(gps_capture *cap, uint64_t time_ns) {
+    if (cap->fd >= 0 && cap->count > 0 &&
+        time_ns - cap->batch[0].time_ns >= CAPTURE_FLUSH_DELAY_NS)
+        capture_flush(cap);
+}
+
+void capture_close(gps_capture *cap) {
+    if (cap->fd < 0)
+        return;
+
+    capture_flush(cap);
+    close(cap->fd);
+    cap->fd = -1;
+}
+
+int capture_replay(const char *path, double speed,
+                   void (*cb)(const gps_fix *fix, void *arg), void *arg) {
+    const capture_header *hdr;
+    const capture_record *rec, *end;
+    struct stat st;
+    void *map;
+    int fd, count = 0;
+    uint64_t first_ns = 0, prev_ns = 0, start_ns = 0;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        SLOGE("GPS:: Unable to open capture %s, errno=%d", path, errno);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    if (st.st_size < (off_t)sizeof(*hdr)) {
+        SLOGE("GPS:: Capture %s is too short", path);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        SLOGE("GPS:: Unable to map capture %s, errno=%d", path, errno);
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    hdr = (const capture_header *)map;
+    if (memcmp(hdr->magic, CAPTURE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != CAPTURE_VERSION || hdr->record_size != CAPTURE_RECORD_SIZE) {
+        SLOGE("GPS:: %s is not a supported capture", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    rec = (const capture_record *)(hdr + 1);
+    end = rec + (st.st_size - sizeof(*hdr)) / CAPTURE_RECORD_SIZE;
+
+    for (; rec < end; rec++) {
+        gps_fix fix;
+
+        if (rec->type != CAPTURE_RECORD_FIX)
+            continue;
+
+        // The monotonic clock restarts when a capture spans a reboot
+        if (count == 0 || rec->time_ns < prev_ns) {
+            first_ns = rec->time_ns;
+            start_ns = gps_clock_ns(CLOCK_MONOTONIC);
+        }
+        prev_ns = rec->time_ns;
+
+        if (speed > 0.) {
+            uint64_t due = start_ns + (uint64_t)((rec->time_ns - first_ns) / speed);
+            gps_clock_sleep_until(due);
+        }
+
+        fix.enabled = rec->u.fix.enabled;
+        fix.latitude = rec->u.fix.latitude;
+        fix.longitude = rec->u.fix.longitude;
+        fix.altitude = rec->u.fix.altitude;
+        fix.bearing = rec->u.fix.bearing;
+        fix.time_ms = rec->u.fix.time_ms;
+        fix.received_ms = 0;
+        fix.seq = 0;
+        cb(&fix, arg);
+        count++;
+    }
+
+    munmap(map, st.st_size);
+    return count;
+}
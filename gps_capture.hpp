@@ -0,0 +1,86 @@
+#ifndef GPS_CAPTURE_H_
+#define GPS_CAPTURE_H_
+
+#include <stdint.h>
+
+#include "local_gps.hpp"
+
+/* Capture file of the simulator traffic received by local_gps.
+ *
+ * The file is a capture_header followed by fixed size records, so record
+ * n is at sizeof(capture_header) + n * CAPTURE_RECORD_SIZE and the file
+ * can be mmapped and searched by time. Every CAPTURE_INDEX_INTERVAL
+ * records an index record ties the monotonic clock to the wall clock and
+ * gives the number of records written so far. Records are written in
+ * batches, written once full or spanning CAPTURE_FLUSH_DELAY_NS.
+ */
+#define CAPTURE_MAGIC           "AICGPSCP"
+#define CAPTURE_VERSION         2
+#define CAPTURE_RECORD_SIZE     64
+#define CAPTURE_INDEX_INTERVAL  64
+#define CAPTURE_FLUSH_DELAY_NS  1000000000ULL
+
+enum {
+    CAPTURE_RECORD_FIX   = 1,
+    CAPTURE_RECORD_INDEX = 2
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t index_interval;
+    uint32_t reserved;
+    uint64_t start_realtime_ns;
+    uint8_t pad[32];
+} capture_header;
+
+typedef struct {
+    uint32_t type;
+    uint32_t seq;               /* record number in the file */
+    uint64_t time_ns;           /* CLOCK_MONOTONIC at arrival */
+    union {
+        struct {
+            int32_t enabled;
+            int32_t reserved;
+            int64_t latitude;   /* GPS_COORD_SCALE units */
+            int64_t longitude;
+            double altitude;
+            double bearing;
+            int64_t time_ms;    /* from the simulator, 0 if none */
+        } fix;
+        struct {
+            uint64_t realtime_ns;
+            uint32_t count;     /* records before this one */
+        } index;
+        uint8_t pad[CAPTURE_RECORD_SIZE - 16];
+    } u;
+} capture_record;
+
+typedef struct {
+    int fd;
+    uint32_t seq;
+    int count;                  /* records waiting in batch */
+    capture_record batch[CAPTURE_INDEX_INTERVAL];
+} gps_capture;
+
+/* Open path for appending, returns -1 on error. A file that is not a
+ * capture of this version is renamed to <path>.old and a new one started */
+int capture_open(gps_capture *cap, const char *path);
+void capture_fix(gps_capture *cap, const gps_fix *fix, uint64_t time_ns);
+void capture_close(gps_capture *cap);
+
+/* Milliseconds until the waiting records are due to be written, -1 if
+ * there are none, for the poll() timeout of the thread that captures */
+int capture_timeout_ms(const gps_capture *cap, uint64_t time_ns);
+
+/* Write the waiting records once due, so that they are not held back
+ * when the simulator goes quiet */
+void capture_tick(gps_capture *cap, uint64_t time_ns);
+
+/* Feed the fixes of a capture to cb, with their original spacing divided
+ * by speed (0 for no delay). Returns the number of fixes, -1 on error */
+int capture_replay(const char *path, double speed,
+                   void (*cb)(const gps_fix *fix, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,184 @@
+#define LOG_TAG "gps_clock"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "gps.hpp"
+#include "gps_clock.hpp"
+#include "gps_seqlock.hpp"
+
+static gps_clock_shared *virtual_clock;
+static int64_t last_monotonic_ns;       /* last consistent read */
+static int64_t last_realtime_ns;
+static int clock_efd = -1;
+static pthread_once_t watch_once = PTHREAD_ONCE_INIT;
+
+int gps_clock_setup(void) {
+    char path[PROPERTY_VALUE_MAX];
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (virtual_clock != NULL)
+        return 1;
+    property_get(GPS_CLOCK_PROPERTY, path, "");
+    if (path[0] == '\0')
+        return 0;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(gps_clock_shared)) {
+        ALOGE("Unable to open the virtual clock %s, errno=%d, system clocks used", path, errno);
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    map = mmap(NULL, sizeof(gps_clock_shared), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    // The test sets the magic last
+    if (__atomic_load_n(&((gps_clock_shared *)map)->magic, __ATOMIC_ACQUIRE) != GPS_CLOCK_MAGIC ||
+        ((gps_clock_shared *)map)->version != GPS_CLOCK_VERSION) {
+        ALOGE("%s is not a virtual clock, system clocks used", path);
+        munmap(map, sizeof(gps_clock_shared));
+        return 0;
+    }
+    virtual_clock = (gps_clock_shared *)map;
+    ALOGI("Virtual clock %s", path);
+    return 1;
+}
+
+/* Both times of the virtual clock, and the seq they were read at. Returns
+ * -1 with the last consistent times if the clock stays in a write */
+static int clock_read(int64_t *monotonic_ns, int64_t *realtime_ns, uint32_t *seq) {
+    for (int retry = 0; retry < GPS_SEQLOCK_READ_RETRIES; retry++) {
+        uint32_t seq1 = gps_seqlock_read_begin(&virtual_clock->seq);
+
+        *monotonic_ns = virtual_clock->monotonic_ns;
+        *realtime_ns = virtual_clock->realtime_ns;
+        if (!gps_seqlock_read_retry(&virtual_clock->seq, seq1)) {
+            __atomic_store_n(&last_monotonic_ns, *monotonic_ns, __ATOMIC_RELAXED);
+            __atomic_store_n(&last_realtime_ns, *realtime_ns, __ATOMIC_RELAXED);
+            *seq = seq1;
+            return 0;
+        }
+    }
+    *monotonic_ns = __atomic_load_n(&last_monotonic_ns, __ATOMIC_RELAXED);
+    *realtime_ns = __atomic_load_n(&last_realtime_ns, __ATOMIC_RELAXED);
+    return -1;
+}
+
+static void sleep_ns(int64_t ns) {
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+int64_t gps_clock_ns(clockid_t clock) {
+    int64_t monotonic_ns, realtime_ns;
+    struct timespec ts;
+    uint32_t seq;
+
+    if (virtual_clock == NULL) {
+        clock_gettime(clock, &ts);
+        return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+    clock_read(&monotonic_ns, &realtime_ns, &seq);
+    return (clock == CLOCK_REALTIME) ? realtime_ns : monotonic_ns;
+}
+
+void gps_clock_sleep_until(int64_t deadline_ns) {
+    int64_t monotonic_ns, realtime_ns;
+    struct timespec ts;
+
+    if (virtual_clock == NULL) {
+        ts.tv_sec = deadline_ns / 1000000000LL;
+        ts.tv_nsec = deadline_ns % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+        return;
+    }
+
+    // Returns at once if the clock moved since it was read
+    for (;;) {
+        uint32_t seq;
+        int stuck = clock_read(&monotonic_ns, &realtime_ns, &seq) < 0;
+
+        if (monotonic_ns >= deadline_ns)
+            return;
+        if (!stuck && (gps_futex(&virtual_clock->seq, FUTEX_WAIT, seq, NULL) == 0 ||
+                       errno == EAGAIN || errno == EINTR))
+            continue;
+
+        // The virtual clock can't be waited for, the rest in real time
+        ALOGW("Virtual clock stuck, sleeping %lld ns in real time",
+              (long long)(deadline_ns - monotonic_ns));
+        sleep_ns(deadline_ns - monotonic_ns);
+        return;
+    }
+}
+
+static void *clock_watch(void *arg) {
+    uint32_t seen = __atomic_load_n(&virtual_clock->seq, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        uint32_t seq;
+
+        // A stuck write just blocks here, only an error stops the thread
+        if (gps_futex(&virtual_clock->seq, FUTEX_WAIT, seen, NULL) < 0 &&
+            errno != EAGAIN && errno != EINTR) {
+            ALOGE("Unable to wait for the virtual clock, errno=%d", errno);
+            break;
+        }
+        seq = __atomic_load_n(&virtual_clock->seq, __ATOMIC_ACQUIRE);
+        if (seq == seen)
+            continue;
+        seen = seq;
+        if (!(seq & 1))
+            eventfd_write(clock_efd, 1);
+    }
+    return NULL;
+}
+
+static void clock_watch_start(void) {
+    pthread_t thread;
+
+    clock_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (clock_efd < 0) {
+        ALOGE("Unable to create the clock event fd, errno=%d", errno);
+        return;
+    }
+    if (pthread_create(&thread, NULL, clock_watch, NULL) != 0) {
+        ALOGE("Unable to start the clock thread");
+        close(clock_efd);
+        clock_efd = -1;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+int gps_clock_fd(void) {
+    if (virtual_clock == NULL)
+        return -1;
+    pthread_once(&watch_once, clock_watch_start);
+    return clock_efd;
+}
+
+void gps_clock_ack(void) {
+    eventfd_t value;
+
+    if (clock_efd >= 0)
+        eventfd_read(clock_efd, &value);
+}
@@ -0,0 +1,55 @@
+#ifndef GPS_CLOCK_H_
+#define GPS_CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#ifndef CLOCK_BOOTTIME
+#define CLOCK_BOOTTIME  7
+#endif
+
+/* Clock of local_gps and the HAL: the system clocks, or a virtual clock
+ * that a test moves forward, so that a long route plays out as fast as
+ * the test goes while the output stays the same as in real time.
+ *
+ * The virtual clock is a file mapped by the driver (gps_clock_drive, or a
+ * test) and by both components, named by GPS_CLOCK_PROPERTY. The driver
+ * writes the time under the seqlock of gps_seqlock.hpp and wakes up the
+ * waiters of the 'seq' futex.
+ * CLOCK_MONOTONIC and CLOCK_BOOTTIME read the same virtual time.
+ *
+ * Both binaries build this file.
+ */
+#define GPS_CLOCK_MAGIC    0x4b4c4347   /* "GCLK" */
+#define GPS_CLOCK_VERSION  1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;
+    uint32_t reserved;
+    int64_t monotonic_ns;
+    int64_t realtime_ns;
+} gps_clock_shared;
+
+/* Map the virtual clock if GPS_CLOCK_PROPERTY is set, before the threads
+ * that read the clock are started. Returns 1 with a virtual clock */
+int gps_clock_setup(void);
+
+/* Time of CLOCK_MONOTONIC, CLOCK_BOOTTIME or CLOCK_REALTIME, in ns */
+int64_t gps_clock_ns(clockid_t clock);
+
+static inline int64_t gps_clock_ms(clockid_t clock) {
+    return gps_clock_ns(clock) / 1000000;
+}
+
+/* Sleep until the CLOCK_MONOTONIC deadline, in nanoseconds */
+void gps_clock_sleep_until(int64_t deadline_ns);
+
+/* Event fd that turns readable each time the virtual clock moves, for a
+ * poll() whose timeout is measured on the clock. -1 with the system
+ * clocks. gps_clock_ack() reads it */
+int gps_clock_fd(void);
+void gps_clock_ack(void);
+
+#endif
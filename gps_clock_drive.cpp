@@ -0,0 +1,123 @@
+#define LOG_TAG "gps_clock_drive"
+
+/* Driver of the virtual clock (see gps_clock.hpp), to run local_gps and
+ * the HAL with aic.gps.clock set. Creates the clock at the current system
+ * times, then moves it forward by step every interval of real time, so
+ * that a route plays out step / interval times as fast.
+ *
+ *   gps_clock_drive [-s step_ms] [-i interval_ms] [-n count] clock
+ *
+ * With no count, it moves the clock until killed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "gps_clock.hpp"
+#include "gps_seqlock.hpp"
+
+#define DRIVE_DEFAULT_STEP_MS      1000
+#define DRIVE_DEFAULT_INTERVAL_MS  100
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s step_ms] [-i interval_ms] [-n count] clock\n", name);
+    exit(1);
+}
+
+static int64_t system_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Create (or reset) the virtual clock of path */
+static int clock_create(const char *path, gps_clock_shared **clock,
+                        int64_t monotonic_ns, int64_t realtime_ns) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    void *map;
+
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, sizeof(gps_clock_shared)) < 0) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, sizeof(gps_clock_shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    *clock = (gps_clock_shared *)map;
+    memset(*clock, 0, sizeof(gps_clock_shared));
+    (*clock)->version = GPS_CLOCK_VERSION;
+    (*clock)->monotonic_ns = monotonic_ns;
+    (*clock)->realtime_ns = realtime_ns;
+    __atomic_store_n(&(*clock)->magic, GPS_CLOCK_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void clock_set(gps_clock_shared *clock, int64_t monotonic_ns, int64_t realtime_ns) {
+    gps_seqlock_write_begin(&clock->seq);
+    clock->monotonic_ns = monotonic_ns;
+    clock->realtime_ns = realtime_ns;
+    gps_seqlock_write_end(&clock->seq);
+    gps_futex(&clock->seq, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+int main(int argc, char *argv[]) {
+    long long step_ms = DRIVE_DEFAULT_STEP_MS, interval_ms = DRIVE_DEFAULT_INTERVAL_MS;
+    long long count = -1;
+    gps_clock_shared *clock;
+    int64_t monotonic_ns, realtime_ns;
+    struct timespec interval;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:i:n:")) != -1) {
+        switch (opt) {
+        case 's':
+            step_ms = atoll(optarg);
+            break;
+        case 'i':
+            interval_ms = atoll(optarg);
+            break;
+        case 'n':
+            count = atoll(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind + 1 != argc || step_ms <= 0 || interval_ms < 0)
+        usage(argv[0]);
+
+    monotonic_ns = system_ns(CLOCK_MONOTONIC);
+    realtime_ns = system_ns(CLOCK_REALTIME);
+    if (clock_create(argv[optind], &clock, monotonic_ns, realtime_ns) < 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    interval.tv_sec = interval_ms / 1000;
+    interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+    for (long long i = 0; count < 0 || i < count; i++) {
+        struct timespec left = interval;
+
+        while (nanosleep(&left, &left) < 0 && errno == EINTR)
+            ;
+        monotonic_ns += step_ms * 1000000LL;
+        realtime_ns += step_ms * 1000000LL;
+        clock_set(clock, monotonic_ns, realtime_ns);
+    }
+
+    munmap(clock, sizeof(gps_clock_shared));
+    return 0;
+}
@@ -0,0 +1,595 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* geofencing extension of the AiC GPS HAL.
+ *
+ * geofences are indexed in a uniform grid of GEOFENCE_CELL_DEG cells, so
+ * a fix is only checked against the geofences around it, plus the ones
+ * it may be leaving (those it is inside of, or in an unknown state) and
+ * the few that are too large to be indexed. transition callbacks are
+ * only called when the state of a geofence changes.
+ *
+ * a geofence with an unknown_timer_ms becomes uncertain when no fix came
+ * for that long, geofence_check() is called by the gps thread for it. it
+ * only scans the geofences once check_at, the earliest deadline, passed:
+ * fixes only push the deadlines back, so check_at is lowered when a
+ * geofence gets one and never raised until the next scan.
+ */
+
+#define  LOG_TAG  "gps_goby"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+#include <hardware/gps.h>
+
+#include "gps.hpp"
+#include "gps_geofence.hpp"
+#include "gps_clock.hpp"
+
+#if GPS_DEBUG
+#  define  D(...)   ALOGD(__VA_ARGS__)
+#else
+#  define  D(...)   ((void)0)
+#endif
+
+#define  GEOFENCE_MAX        1024
+#define  GEOFENCE_CELL_DEG   0.01     /* about 1.1 km of latitude */
+#define  GEOFENCE_MAX_CELLS  64       /* larger geofences are always checked */
+#define  GEOFENCE_BUCKETS    1024
+
+#define  GEOFENCE_TRANSITIONS  (GPS_GEOFENCE_ENTERED | GPS_GEOFENCE_EXITED | \
+                                GPS_GEOFENCE_UNCERTAIN)
+
+enum {
+    FENCE_UNKNOWN = 0,
+    FENCE_OUTSIDE,
+    FENCE_INSIDE
+};
+
+typedef struct {
+    int         used;
+    int32_t     id;
+    double      latitude;
+    double      longitude;
+    double      radius;
+    int         monitor;        /* transitions to report */
+    int         paused;
+    int         state;
+    int         dwelt;          /* dwell logged for the current stay */
+    GpsUtcTime  entered_at;     /* -1 until the first fix inside */
+    int         indexed;
+    int         row0, row1;     /* grid cells covered */
+    int         col0, col1;
+    int         active;         /* index in GeofenceState.active, or -1 */
+    unsigned    mark;           /* last update that looked at it */
+    int         unknown_timer_ms;   /* 0 to never go uncertain */
+    long long   since_ms;       /* added or resumed, elapsed realtime */
+} Geofence;
+
+typedef struct CellEntry {
+    int                 row;
+    int                 col;
+    Geofence*           fence;
+    struct CellEntry*   next;
+} CellEntry;
+
+typedef struct {
+    int32_t  id;
+    int32_t  transition;
+} Transition;
+
+typedef struct {
+    int                   init;
+    GpsGeofenceCallbacks  callbacks;
+    Geofence              fences[ GEOFENCE_MAX ];
+    CellEntry*            buckets[ GEOFENCE_BUCKETS ];
+    /* geofences checked on every fix: inside, unknown or not indexed */
+    Geofence*             active[ GEOFENCE_MAX ];
+    int                   active_count;
+    unsigned              mark;
+    int                   monitored;    /* used and not paused */
+    long long             fix_ms;       /* last fix, elapsed realtime */
+    long long             check_at;     /* no geofence goes uncertain before, -1 if none can */
+    GpsLocation           last_fix;     /* reported with uncertain transitions */
+    /* only used by geofence_update() and geofence_check(), from the gps thread */
+    Transition            pending[ GEOFENCE_MAX ];
+} GeofenceState;
+
+static GeofenceState    _geofence_state[1];
+static pthread_mutex_t  _geofence_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*****************************************************************/
+/*****                                                       *****/
+/*****       S P A T I A L   I N D E X                       *****/
+/*****                                                       *****/
+/*****************************************************************/
+
+static int
+grid_cell( double  deg )
+{
+    return (int) floor( deg / GEOFENCE_CELL_DEG );
+}
+
+static unsigned
+grid_bucket( int  row, int  col )
+{
+    return ((unsigned)row * 73856093u ^ (unsigned)col * 19349663u) % GEOFENCE_BUCKETS;
+}
+
+static void
+geofence_index( GeofenceState*  s, Geofence*  f )
+{
+    double  dlat = f->radius / GPS_METERS_PER_DEG;
+    double  coslat = cos( f->latitude * M_PI / 180. );
+    double  dlon;
+    int     row, col;
+
+    f->indexed = 0;
+
+    // near the poles or across the antimeridian, don't bother
+    if (coslat < 0.01)
+        return;
+    dlon = dlat / coslat;
+    if (f->longitude - dlon < -180. || f->longitude + dlon > 180.)
+        return;
+
+    f->row0 = grid_cell( f->latitude - dlat );
+    f->row1 = grid_cell( f->latitude + dlat );
+    f->col0 = grid_cell( f->longitude - dlon );
+    f->col1 = grid_cell( f->longitude + dlon );
+
+    if ((f->row1 - f->row0 + 1) * (f->col1 - f->col0 + 1) > GEOFENCE_MAX_CELLS)
+        return;
+
+    for (row = f->row0; row <= f->row1; row++) {
+        for (col = f->col0; col <= f->col1; col++) {
+            CellEntry*  e = (CellEntry*) malloc( sizeof(*e) );
+            unsigned    b = grid_bucket( row, col );
+
+            if (e == NULL) {
+                ALOGE("%s: out of memory", __FUNCTION__);
+                continue;
+            }
+            e->row   = row;
+            e->col   = col;
+            e->fence = f;
+            e->next  = s->buckets[b];
+            s->buckets[b] = e;
+        }
+    }
+    f->indexed = 1;
+}
+
+static void
+geofence_unindex( GeofenceState*  s, Geofence*  f )
+{
+    int  row, col;
+
+    if (!f->indexed)
+        return;
+
+    for (row = f->row0; row <= f->row1; row++) {
+        for (col = f->col0; col <= f->col1; col++) {
+            CellEntry**  pe = &s->buckets[ grid_bucket( row, col ) ];
+
+            while (*pe != NULL) {
+                CellEntry*  e = *pe;
+                if (e->fence == f && e->row == row && e->col == col) {
+                    *pe = e->next;
+                    free( e );
+                    break;
+                }
+                pe = &e->next;
+            }
+        }
+    }
+    f->indexed = 0;
+}
+
+/* keep the active list in sync with the state of a geofence */
+static void
+geofence_refresh_active( GeofenceState*  s, Geofence*  f )
+{
+    int  want = f->used && !f->paused &&
+                (f->state != FENCE_OUTSIDE || !f->indexed);
+
+    if (want && f->active < 0) {
+        f->active = s->active_count;
+        s->active[ s->active_count++ ] = f;
+    } else if (!want && f->active >= 0) {
+        Geofence*  last = s->active[ --s->active_count ];
+        s->active[ f->active ] = last;
+        last->active = f->active;
+        f->active = -1;
+    }
+}
+
+static Geofence*
+geofence_find( GeofenceState*  s, int32_t  id )
+{
+    int  n;
+
+    for (n = 0; n < GEOFENCE_MAX; n++) {
+        if (s->fences[n].used && s->fences[n].id == id)
+            return &s->fences[n];
+    }
+    return NULL;
+}
+
+
+/*****************************************************************/
+/*****                                                       *****/
+/*****       E V A L U A T I O N                             *****/
+/*****                                                       *****/
+/*****************************************************************/
+
+/* time at which f goes uncertain without a fix, -1 if it never does */
+static long long
+geofence_due( GeofenceState*  s, Geofence*  f )
+{
+    if (!f->used || f->paused || f->state == FENCE_UNKNOWN || f->unknown_timer_ms <= 0)
+        return -1;
+    return ((s->fix_ms > f->since_ms) ? s->fix_ms : f->since_ms) + f->unknown_timer_ms;
+}
+
+static void
+geofence_schedule( GeofenceState*  s, Geofence*  f )
+{
+    long long  due = geofence_due( s, f );
+
+    if (due >= 0 && (s->check_at < 0 || due < s->check_at))
+        s->check_at = due;
+}
+
+static int
+geofence_evaluate( GeofenceState*  s, Geofence*  f, const GpsLocation*  fix,
+                   double  coslat, Transition*  out )
+{
+    double  dy, dx;
+    int     inside, count = 0;
+
+    if (f->mark == s->mark || f->paused)
+        return 0;
+    f->mark = s->mark;
+
+    dy = (fix->latitude - f->latitude) * GPS_METERS_PER_DEG;
+    dx = (fix->longitude - f->longitude) * GPS_METERS_PER_DEG * coslat;
+    inside = (dx*dx + dy*dy <= f->radius * f->radius);
+
+    // an unknown state is resolved either way and reported like a change
+    if (f->state != (inside ? FENCE_INSIDE : FENCE_OUTSIDE)) {
+        int32_t  transition = inside ? GPS_GEOFENCE_ENTERED : GPS_GEOFENCE_EXITED;
+
+        if (f->monitor & transition) {
+            out[count].id         = f->id;
+            out[count].transition = transition;
+            count++;
+        }
+        f->state      = inside ? FENCE_INSIDE : FENCE_OUTSIDE;
+        f->dwelt      = 0;
+        f->entered_at = -1;
+        geofence_refresh_active( s, f );
+        geofence_schedule( s, f );
+    }
+
+    if (inside) {
+        if (f->entered_at < 0)
+            f->entered_at = fix->timestamp;
+
+        // not a transition of the HAL API, see GEOFENCE_DWELL_MS
+        if (!f->dwelt && fix->timestamp - f->entered_at >= GEOFENCE_DWELL_MS) {
+            D("geofence %d dwell", f->id);
+            f->dwelt = 1;
+        }
+    }
+    return count;
+}
+
+void
+geofence_update( const GpsLocation*  fix )
+{
+    GeofenceState*  s = _geofence_state;
+    GpsLocation     location = *fix;
+    double          coslat;
+    CellEntry*      e;
+    int             n, count = 0, row, col;
+
+    if (!(fix->flags & GPS_LOCATION_HAS_LAT_LONG))
+        return;
+
+    pthread_mutex_lock( &_geofence_lock );
+
+    if (!s->init) {
+        pthread_mutex_unlock( &_geofence_lock );
+        return;
+    }
+
+    s->mark    += 1;
+    s->fix_ms   = gps_clock_ms( CLOCK_BOOTTIME );
+    s->last_fix = *fix;
+    coslat      = cos( fix->latitude * M_PI / 180. );
+
+    // backwards: a geofence leaving the list is replaced by one already seen
+    for (n = s->active_count - 1; n >= 0; n--)
+        count += geofence_evaluate( s, s->active[n], fix, coslat, s->pending + count );
+
+    row = grid_cell( fix->latitude );
+    col = grid_cell( fix->longitude );
+    for (e = s->buckets[ grid_bucket( row, col ) ]; e != NULL; e = e->next) {
+        if (e->row == row && e->col == col)
+            count += geofence_evaluate( s, e->fence, fix, coslat, s->pending + count );
+    }
+
+    pthread_mutex_unlock( &_geofence_lock );
+
+    for (n = 0; n < count; n++) {
+        D("geofence %d transition %d", s->pending[n].id, s->pending[n].transition);
+        s->callbacks.geofence_transition_callback( s->pending[n].id, &location,
+                                                   s->pending[n].transition,
+                                                   location.timestamp );
+    }
+}
+
+
+int
+geofence_check( void )
+{
+    GeofenceState*  s = _geofence_state;
+    GpsLocation     location;
+    long long       now = gps_clock_ms( CLOCK_BOOTTIME );
+    long long       next = -1;
+    int             n, count = 0;
+
+    pthread_mutex_lock( &_geofence_lock );
+
+    if (!s->init || s->check_at < 0) {
+        pthread_mutex_unlock( &_geofence_lock );
+        return -1;
+    }
+    if (now < s->check_at) {
+        next = s->check_at - now;
+        pthread_mutex_unlock( &_geofence_lock );
+        return (int) next;
+    }
+
+    s->check_at = -1;
+    for (n = 0; n < GEOFENCE_MAX; n++) {
+        Geofence*  f = &s->fences[n];
+        long long  due = geofence_due( s, f );
+
+        if (due < 0)
+            continue;
+        if (due > now) {
+            geofence_schedule( s, f );
+            continue;
+        }
+
+        // resolved again by the next fix, like a new geofence
+        if (f->monitor & GPS_GEOFENCE_UNCERTAIN) {
+            s->pending[count].id         = f->id;
+            s->pending[count].transition = GPS_GEOFENCE_UNCERTAIN;
+            count++;
+        }
+        f->state      = FENCE_UNKNOWN;
+        f->dwelt      = 0;
+        f->entered_at = -1;
+        geofence_refresh_active( s, f );
+    }
+
+    if (s->check_at >= 0)
+        next = s->check_at - now;
+    location = s->last_fix;
+    location.size = sizeof(location);
+    pthread_mutex_unlock( &_geofence_lock );
+
+    for (n = 0; n < count; n++) {
+        D("geofence %d uncertain", s->pending[n].id);
+        s->callbacks.geofence_transition_callback( s->pending[n].id, &location,
+                                                   GPS_GEOFENCE_UNCERTAIN,
+                                                   location.timestamp );
+    }
+    return (int) next;
+}
+
+
+int
+geofence_monitoring( void )
+{
+    GeofenceState*  s = _geofence_state;
+    int             count;
+
+    pthread_mutex_lock( &_geofence_lock );
+    count = s->monitored;
+    pthread_mutex_unlock( &_geofence_lock );
+    return count;
+}
+
+
+/*****************************************************************/
+/*****                                                       *****/
+/*****       I N T E R F A C E                               *****/
+/*****                                                       *****/
+/*****************************************************************/
+
+static void
+geofence_init( GpsGeofenceCallbacks*  callbacks )
+{
+    GeofenceState*  s = _geofence_state;
+
+    pthread_mutex_lock( &_geofence_lock );
+    s->callbacks = *callbacks;
+    s->init      = 1;
+    pthread_mutex_unlock( &_geofence_lock );
+}
+
+static void
+geofence_add_area( int32_t  id, double  latitude, double  longitude,
+                   double  radius_meters, int  last_transition,
+                   int  monitor_transitions, int  notification_responsiveness_ms,
+                   int  unknown_timer_ms )
+{
+    GeofenceState*  s = _geofence_state;
+    Geofence*       f = NULL;
+    int             status = GPS_GEOFENCE_OPERATION_SUCCESS;
+    int             n;
+
+    pthread_mutex_lock( &_geofence_lock );
+
+    if (geofence_find( s, id ) != NULL) {
+        status = GPS_GEOFENCE_ERROR_ID_EXISTS;
+    } else if ((monitor_transitions & ~GEOFENCE_TRANSITIONS) != 0 || radius_meters <= 0.) {
+        status = GPS_GEOFENCE_ERROR_INVALID_TRANSITION;
+    } else {
+        for (n = 0; n < GEOFENCE_MAX && f == NULL; n++) {
+            if (!s->fences[n].used)
+                f = &s->fences[n];
+        }
+        if (f == NULL)
+            status = GPS_GEOFENCE_ERROR_TOO_MANY_GEOFENCES;
+    }
+
+    if (f != NULL) {
+        memset( f, 0, sizeof(*f) );
+        f->used       = 1;
+        f->id         = id;
+        f->latitude   = latitude;
+        f->longitude  = longitude;
+        f->radius     = radius_meters;
+        f->monitor    = monitor_transitions;
+        f->entered_at = -1;
+        f->active     = -1;
+        f->mark       = s->mark;
+        f->unknown_timer_ms = unknown_timer_ms;
+        f->since_ms   = gps_clock_ms( CLOCK_BOOTTIME );
+        if (last_transition == GPS_GEOFENCE_ENTERED)
+            f->state = FENCE_INSIDE;
+        else if (last_transition == GPS_GEOFENCE_EXITED)
+            f->state = FENCE_OUTSIDE;
+        else
+            f->state = FENCE_UNKNOWN;
+
+        geofence_index( s, f );
+        geofence_refresh_active( s, f );
+        geofence_schedule( s, f );
+        s->monitored += 1;
+    }
+
+    pthread_mutex_unlock( &_geofence_lock );
+
+    D("%s: geofence %d status %d", __FUNCTION__, id, status);
+    if (f != NULL)
+        gps_geofence_changed();
+    if (s->callbacks.geofence_add_callback)
+        s->callbacks.geofence_add_callback( id, status );
+}
+
+static void
+geofence_pause( int32_t  id )
+{
+    GeofenceState*  s = _geofence_state;
+    Geofence*       f;
+    int             status = GPS_GEOFENCE_OPERATION_SUCCESS;
+
+    pthread_mutex_lock( &_geofence_lock );
+    if ((f = geofence_find( s, id )) != NULL) {
+        if (!f->paused)
+            s->monitored -= 1;
+        f->paused = 1;
+        geofence_refresh_active( s, f );
+    } else {
+        status = GPS_GEOFENCE_ERROR_ID_UNKNOWN;
+    }
+    pthread_mutex_unlock( &_geofence_lock );
+
+    if (f != NULL)
+        gps_geofence_changed();
+
+    if (s->callbacks.geofence_pause_callback)
+        s->callbacks.geofence_pause_callback( id, status );
+}
+
+static void
+geofence_resume( int32_t  id, int  monitor_transitions )
+{
+    GeofenceState*  s = _geofence_state;
+    Geofence*       f;
+    int             status = GPS_GEOFENCE_OPERATION_SUCCESS;
+
+    pthread_mutex_lock( &_geofence_lock );
+    if ((f = geofence_find( s, id )) == NULL) {
+        status = GPS_GEOFENCE_ERROR_ID_UNKNOWN;
+    } else if ((monitor_transitions & ~GEOFENCE_TRANSITIONS) != 0) {
+        status = GPS_GEOFENCE_ERROR_INVALID_TRANSITION;
+    } else {
+        // the device may have moved while paused, check it again
+        if (f->paused)
+            s->monitored += 1;
+        f->paused     = 0;
+        f->monitor    = monitor_transitions;
+        f->state      = FENCE_UNKNOWN;
+        f->dwelt      = 0;
+        f->entered_at = -1;
+        f->since_ms   = gps_clock_ms( CLOCK_BOOTTIME );
+        geofence_refresh_active( s, f );
+    }
+    pthread_mutex_unlock( &_geofence_lock );
+
+    if (status == GPS_GEOFENCE_OPERATION_SUCCESS)
+        gps_geofence_changed();
+    if (s->callbacks.geofence_resume_callback)
+        s->callbacks.geofence_resume_callback( id, status );
+}
+
+static void
+geofence_remove_area( int32_t  id )
+{
+    GeofenceState*  s = _geofence_state;
+    Geofence*       f;
+    int             status = GPS_GEOFENCE_OPERATION_SUCCESS;
+
+    pthread_mutex_lock( &_geofence_lock );
+    if ((f = geofence_find( s, id )) != NULL) {
+        if (!f->paused)
+            s->monitored -= 1;
+        geofence_unindex( s, f );
+        f->used = 0;
+        geofence_refresh_active( s, f );
+    } else {
+        status = GPS_GEOFENCE_ERROR_ID_UNKNOWN;
+    }
+    pthread_mutex_unlock( &_geofence_lock );
+
+    if (f != NULL)
+        gps_geofence_changed();
+
+    if (s->callbacks.geofence_remove_callback)
+        s->callbacks.geofence_remove_callback( id, status );
+}
+
+const GpsGeofencingInterface  gpsGeofencingInterface = {
+    sizeof(GpsGeofencingInterface),
+    geofence_init,
+    geofence_add_area,
+    geofence_pause,
+    geofence_resume,
+    geofence_remove_area,
+};
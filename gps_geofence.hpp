@@ -0,0 +1,29 @@
+#ifndef GPS_GEOFENCE_H_
+#define GPS_GEOFENCE_H_
+
+#include <hardware/gps.h>
+
+/* the HAL API has no dwell transition: a device that stayed inside a
+ * geofence for GEOFENCE_DWELL_MS is only logged, the framework only gets
+ * GPS_GEOFENCE_ENTERED, GPS_GEOFENCE_EXITED and GPS_GEOFENCE_UNCERTAIN */
+#define  GEOFENCE_DWELL_MS    60000
+
+extern const GpsGeofencingInterface  gpsGeofencingInterface;
+
+/* evaluate the geofences against a new fix, called by the gps thread */
+void geofence_update( const GpsLocation*  fix );
+
+/* report GPS_GEOFENCE_UNCERTAIN for the geofences whose unknown_timer_ms
+ * elapsed without a fix, called by the gps thread. returns the delay in
+ * ms until it should be called again, -1 if no geofence can go uncertain */
+int geofence_check( void );
+
+/* number of geofences being monitored (added and not paused), local_gps
+ * must keep sending fixes while there is one */
+int geofence_monitoring( void );
+
+/* implemented by the HAL: the set of monitored geofences changed, called
+ * after an add, pause, resume or remove */
+void gps_geofence_changed( void );
+
+#endif
@@ -0,0 +1,213 @@
+#define LOG_TAG "gps_geofence_test"
+
+/* Geofences with the framework session stopped: the HAL stands in for
+ * local_gps here, on the local socket it connects to, and checks that
+ *  - the session is started while a geofence is monitored, and stopped
+ *    once there is none left
+ *  - fixes received meanwhile reach the geofences, not location_cb
+ *
+ *   gps_geofence_test
+ *
+ * Exits with 0 when all the checks pass.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <hardware/gps.h>
+
+#include "gps.hpp"
+
+#define TEST_WAIT_MS  3000
+#define TEST_FENCE    42
+
+static int locations;
+static int transitions;
+static int last_transition;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static int failures;
+
+static void location_cb(GpsLocation *location) {
+    pthread_mutex_lock(&lock);
+    locations++;
+    pthread_mutex_unlock(&lock);
+}
+
+static void status_cb(GpsStatus *status) {
+}
+
+typedef struct {
+    void (*start)(void *);
+    void *arg;
+} thread_args;
+
+static void *thread_main(void *arg) {
+    thread_args args = *(thread_args *)arg;
+
+    free(arg);
+    args.start(args.arg);
+    return NULL;
+}
+
+static pthread_t create_thread_cb(const char *name, void (*start)(void *), void *arg) {
+    thread_args *args = (thread_args *)malloc(sizeof(thread_args));
+    pthread_t thread;
+
+    args->start = start;
+    args->arg = arg;
+    if (pthread_create(&thread, NULL, thread_main, args) != 0) {
+        free(args);
+        return 0;
+    }
+    return thread;
+}
+
+static void transition_cb(int32_t id, GpsLocation *location, int32_t transition,
+                          GpsUtcTime timestamp) {
+    pthread_mutex_lock(&lock);
+    transitions++;
+    last_transition = transition;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+static void check(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok)
+        failures++;
+}
+
+/* The next session command the HAL sent, 0 if none came */
+static char read_session(int fd) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    char cmd;
+
+    if (poll(&pfd, 1, TEST_WAIT_MS) <= 0 || recv(fd, &cmd, 1, 0) != 1)
+        return 0;
+    return cmd;
+}
+
+/* Send a GGA and RMC pair at latitude, longitude, as local_gps would */
+static void send_fix(int fd, const char *time, const char *latitude, const char *longitude) {
+    char msg[GPS_MAX_MESSAGE_SIZE];
+    char sentence[128];
+    int len = 0;
+
+    for (int i = 0; i < 2; i++) {
+        unsigned sum = 0;
+        int n;
+
+        if (i == 0)
+            n = snprintf(sentence, sizeof(sentence), "GPGGA,%s,%s,%s,1,08,5,10.0,M,0.,M,,,",
+                         time, latitude, longitude);
+        else
+            n = snprintf(sentence, sizeof(sentence), "GPRMC,%s,A,%s,%s,0.0,0.0,181026,0.0,",
+                         time, latitude, longitude);
+        for (int k = 0; k < n; k++)
+            sum ^= (unsigned char)sentence[k];
+        len += snprintf(msg + len, sizeof(msg) - len, "$%s*%02X\n", sentence, sum);
+    }
+    send(fd, msg, len, MSG_NOSIGNAL);
+}
+
+/* Wait for transition count to reach count */
+static int wait_transitions(int count) {
+    struct timespec deadline;
+    int reached;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TEST_WAIT_MS / 1000;
+    pthread_mutex_lock(&lock);
+    while (transitions < count &&
+           pthread_cond_timedwait(&changed, &lock, &deadline) != ETIMEDOUT)
+        ;
+    reached = transitions >= count;
+    pthread_mutex_unlock(&lock);
+    return reached;
+}
+
+int main(int argc, char *argv[]) {
+    extern struct hw_module_t HAL_MODULE_INFO_SYM;
+    GpsCallbacks callbacks;
+    GpsGeofenceCallbacks geofence_callbacks;
+    const GpsInterface *gps;
+    const GpsGeofencingInterface *geofencing;
+    struct hw_device_t *device;
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    int server, fd;
+
+    // local_gps, on the abstract socket of the HAL
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_LOCAL;
+    strcpy(addr.sun_path + 1, GPS_SOCKET_NAME);
+    addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(GPS_SOCKET_NAME);
+    server = socket(AF_LOCAL, SOCK_SEQPACKET, 0);
+    if (server < 0 || bind(server, (struct sockaddr *)&addr, addr_len) < 0 || listen(server, 1) < 0) {
+        fprintf(stderr, "Unable to listen on @%s: %s\n", GPS_SOCKET_NAME, strerror(errno));
+        return 1;
+    }
+
+    HAL_MODULE_INFO_SYM.methods->open(&HAL_MODULE_INFO_SYM, GPS_HARDWARE_MODULE_ID, &device);
+    gps = ((struct gps_device_t *)device)->get_gps_interface((struct gps_device_t *)device);
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.size = sizeof(callbacks);
+    callbacks.location_cb = location_cb;
+    callbacks.status_cb = status_cb;
+    callbacks.create_thread_cb = create_thread_cb;
+    if (gps->init(&callbacks) < 0) {
+        fprintf(stderr, "Unable to initialize the HAL\n");
+        return 1;
+    }
+
+    memset(&geofence_callbacks, 0, sizeof(geofence_callbacks));
+    geofence_callbacks.geofence_transition_callback = transition_cb;
+    geofence_callbacks.create_thread_cb = create_thread_cb;
+    geofencing = (const GpsGeofencingInterface *)gps->get_extension(GPS_GEOFENCING_INTERFACE);
+    geofencing->init(&geofence_callbacks);
+
+    if ((fd = accept(server, NULL, NULL)) < 0) {
+        fprintf(stderr, "The HAL did not connect: %s\n", strerror(errno));
+        return 1;
+    }
+    check(read_session(fd) == GPS_SESSION_STOP, "no session without a geofence");
+
+    // The framework never starts navigating
+    geofencing->add_geofence_area(TEST_FENCE, 48.0, 11.0, 100., GPS_GEOFENCE_UNCERTAIN,
+                                  GPS_GEOFENCE_ENTERED | GPS_GEOFENCE_EXITED, 0, 0);
+    check(read_session(fd) == GPS_SESSION_START, "session started for the geofence");
+
+    send_fix(fd, "101500.000", "4800.000000,N", "01100.000000,E");
+    check(wait_transitions(1) && last_transition == GPS_GEOFENCE_ENTERED,
+          "geofence entered with the session stopped");
+    send_fix(fd, "101501.000", "4801.000000,N", "01100.000000,E");
+    check(wait_transitions(2) && last_transition == GPS_GEOFENCE_EXITED,
+          "geofence exited with the session stopped");
+
+    geofencing->pause_geofence(TEST_FENCE);
+    check(read_session(fd) == GPS_SESSION_STOP, "session stopped with the geofence paused");
+    geofencing->resume_geofence(TEST_FENCE, GPS_GEOFENCE_ENTERED | GPS_GEOFENCE_EXITED);
+    check(read_session(fd) == GPS_SESSION_START, "session started again on resume");
+    geofencing->remove_geofence_area(TEST_FENCE);
+    check(read_session(fd) == GPS_SESSION_STOP, "session stopped once no geofence is left");
+
+    pthread_mutex_lock(&lock);
+    check(locations == 0, "no location delivered to the framework");
+    pthread_mutex_unlock(&lock);
+
+    gps->cleanup();
+    close(fd);
+    close(server);
+    return failures ? 1 : 0;
+}
@@ -24,9 +24,12 @@
 
 
 #include <errno.h>
+#include <stdio.h>
 #include <pthread.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <math.h>
 #include <time.h>
 
@@ -34,7 +37,10 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <cutils/sockets.h>
+#include <cutils/properties.h>
 #include <hardware/gps.h>
 
 #define  LOG_TAG  "gps_goby"
@@ -53,17 +59,11 @@
 /*****************************************************************/
 /*****************************************************************/
 
-typedef struct {
-
-    char buff[128];
-    int init;
-    char*  p;
-    char*  end;
-} Token;
-
-
 #include "gps.hpp"
 #include "gps_goby.hpp"
+#include "gps_geofence.hpp"
+#include "gps_trace.hpp"
+#include "gps_clock.hpp"
 
 #define  MAX_NMEA_TOKENS  16
 
@@ -72,8 +72,6 @@ typedef struct {
     Token   tokens[ MAX_NMEA_TOKENS ];
 } NmeaTokenizer;
 
-static t_all_tokens tokens;
-
 static int
 nmea_tokenizer_init( NmeaTokenizer*  t, const char*  p, const char*  end )
 {
@@ -105,10 +103,17 @@ nmea_tokenizer_init( NmeaTokenizer*  t, const char*  p, const char*  end )
 
         if (q > p) {
             if (count < MAX_NMEA_TOKENS) {
-                snprintf(t->tokens[count].buff, sizeof(t->tokens[count].buff), "%s", p);
-                t->tokens[count].p = t->tokens[count].buff;
-                t->tokens[count].end = t->tokens[count].p + (q - p);
-                t->tokens[count].init = 1;
+                Token*  tok = &t->tokens[count];
+                int     len = q - p;
+
+                // only the field, the line may not be NUL terminated
+                if (len > (int)sizeof(tok->buff) - 1)
+                    len = sizeof(tok->buff) - 1;
+                memcpy(tok->buff, p, len);
+                tok->buff[len] = 0;
+                tok->p    = tok->buff;
+                tok->end  = tok->p + len;
+                tok->init = 1;
                 count += 1;
             }
         }
@@ -130,9 +135,11 @@ nmea_tokenizer_get( NmeaTokenizer*  t, int  index, Token *tok)
         tok->p = tok->buff;
         tok->end = tok->p;
     } else {
-        snprintf(tok->buff, sizeof(tok->buff), "%s", t->tokens[index].p);
+        int  len = t->tokens[index].end - t->tokens[index].p;
+
+        memcpy(tok->buff, t->tokens[index].p, len + 1);
         tok->p = tok->buff;
-        tok->end = tok->p + (t->tokens[index].end - t->tokens[index].p);
+        tok->end = tok->p + len;
     }
     tok->init = 1;
 }
@@ -163,6 +170,45 @@ Fail:
     return -1;
 }
 
+static int
+hex2int( int  c )
+{
+    if ((unsigned)(c - '0') < 10)
+        return c - '0';
+    if ((unsigned)(c - 'A') < 6)
+        return c - 'A' + 10;
+    if ((unsigned)(c - 'a') < 6)
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* returns 1 if the sentence, from its '$' to its line end, carries a
+ * valid '*hh' checksum */
+static int
+nmea_checksum_valid( const char*  p, const char*  end )
+{
+    int  hi, lo;
+
+    if (p < end && p[0] == '$')
+        p += 1;
+
+    if (end > p && end[-1] == '\n') {
+        end -= 1;
+        if (end > p && end[-1] == '\r')
+            end -= 1;
+    }
+
+    if (end < p+3 || end[-3] != '*')
+        return 0;
+
+    hi = hex2int(end[-2]);
+    lo = hex2int(end[-1]);
+    if (hi < 0 || lo < 0)
+        return 0;
+
+    return nmea_checksum(p, end-3) == (unsigned)(hi*16 + lo);
+}
+
 static double
 str2float( const char*  p, const char*  end )
 {
@@ -181,12 +227,101 @@ str2float( const char*  p, const char*  end )
 /*****************************************************************/
 /*****************************************************************/
 /*****                                                       *****/
-/*****       N M E A   P A R S E R                           *****/
+/*****       L A S T   K N O W N   F I X                     *****/
 /*****                                                       *****/
 /*****************************************************************/
 /*****************************************************************/
 
-#define  NMEA_MAX_SIZE  83
+/* the last fix parsed is kept in a small file mapped in memory, so that
+ * after a restart the framework gets a position as soon as it starts a
+ * session instead of waiting for local_gps. saving it is a plain copy
+ * into the mapping, written back by the kernel.
+ *
+ * 'seq' is odd while a copy is in progress: a fix torn by a crash in the
+ * middle of it is discarded when loaded.
+ */
+#define  GPS_LAST_FIX_FILE     "/data/system/gps_last_fix"
+#define  GPS_LAST_FIX_MAGIC    0x46584c47   /* 'GLXF' */
+
+typedef struct {
+    uint32_t     magic;
+    uint32_t     size;
+    uint32_t     seq;
+    GpsLocation  fix;
+} GpsLastFix;
+
+static GpsLastFix*  _last_fix = NULL;
+
+
+static void
+gps_last_fix_open( void )
+{
+    void*  map;
+    int    fd;
+
+    if (_last_fix != NULL)
+        return;
+
+    fd = open( GPS_LAST_FIX_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0600 );
+    if (fd < 0) {
+        ALOGW("could not open %s: %s, last fix not persisted", GPS_LAST_FIX_FILE, strerror(errno));
+        return;
+    }
+    if (ftruncate( fd, sizeof(GpsLastFix) ) < 0) {
+        ALOGW("could not resize %s: %s, last fix not persisted", GPS_LAST_FIX_FILE, strerror(errno));
+        close( fd );
+        return;
+    }
+    map = mmap( NULL, sizeof(GpsLastFix), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if (map == MAP_FAILED) {
+        ALOGW("could not map %s: %s, last fix not persisted", GPS_LAST_FIX_FILE, strerror(errno));
+        return;
+    }
+    _last_fix = (GpsLastFix*) map;
+}
+
+
+/* returns 0 if no valid fix was persisted */
+static int
+gps_last_fix_load( GpsLocation*  fix )
+{
+    GpsLastFix*  f = _last_fix;
+
+    if (f == NULL || f->magic != GPS_LAST_FIX_MAGIC ||
+        f->size != sizeof(GpsLocation) || (f->seq & 1) != 0 ||
+        f->fix.flags == 0)
+        return 0;
+
+    *fix = f->fix;
+    return 1;
+}
+
+
+static void
+gps_last_fix_save( const GpsLocation*  fix )
+{
+    GpsLastFix*  f = _last_fix;
+
+    if (f == NULL)
+        return;
+
+    __atomic_store_n( &f->seq, f->seq | 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    f->magic = GPS_LAST_FIX_MAGIC;
+    f->size  = sizeof(GpsLocation);
+    f->fix   = *fix;
+    __atomic_store_n( &f->seq, f->seq + 1, __ATOMIC_RELEASE );
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       N M E A   P A R S E R                           *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
 
 typedef struct {
     int     pos;
@@ -194,45 +329,74 @@ typedef struct {
     int     utc_year;
     int     utc_mon;
     int     utc_day;
-    int     utc_diff;
+    int     check_checksum;
+    unsigned  rejected;     /* sentences with a wrong or missing checksum */
+    int     seeded;         /* fix not from local_gps: persisted or injected */
+    double  suppress_m;     /* 0 to deliver every fix */
+    long long  keepalive_ms;
+    long long  delivered_ms;
+    unsigned   suppressed;
+    int     has_utc_offset;
+    long long  utc_offset;  /* injected UTC time minus elapsed realtime, in ms */
     GpsLocation  fix;
+    GpsLocation  last_fix;
     gps_location_callback  callback;
+    t_all_tokens  tokens;   /* fields of the last GGA and RMC sentences */
     char    in[ NMEA_MAX_SIZE+1 ];
 } NmeaReader;
 
 
-static void
-nmea_reader_update_utc_diff( NmeaReader*  r )
+/* seconds since the epoch of a UTC date and time. computed from the
+ * civil calendar rather than with mktime(), which goes through the local
+ * time zone and takes the libc time zone lock on every call */
+static long long
+nmea_utc_seconds( int  year, int  mon, int  day, int  hour, int  minute, int  seconds )
 {
-    time_t         now = time(NULL);
-    struct tm      tm_local;
-    struct tm      tm_utc;
-    long           time_local, time_utc;
+    long long  y   = year - (mon <= 2);
+    long long  era = (y >= 0 ? y : y - 399) / 400;
+    int        yoe = (int)(y - era * 400);
+    int        doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+    long long  days = era * 146097 + yoe * 365 + yoe/4 - yoe/100 + doy - 719468;
+
+    return days * 86400 + hour * 3600 + minute * 60 + seconds;
+}
+
 
-    gmtime_r( &now, &tm_utc );
-    localtime_r( &now, &tm_local );
+/* elapsed realtime in ms, the reference of the time injected by the framework */
+static long long
+nmea_elapsed_ms( void )
+{
+    return gps_clock_ms( CLOCK_BOOTTIME );
+}
 
-    time_local = tm_local.tm_sec +
-                 60*(tm_local.tm_min +
-                 60*(tm_local.tm_hour +
-                 24*(tm_local.tm_yday +
-                 365*tm_local.tm_year)));
 
-    time_utc = tm_utc.tm_sec +
-               60*(tm_utc.tm_min +
-               60*(tm_utc.tm_hour +
-               24*(tm_utc.tm_yday +
-               365*tm_utc.tm_year)));
+/* current UTC time in ms: from the injected time when there is one, as
+ * the system clock may not be set yet right after boot */
+static long long
+nmea_reader_utc_ms( NmeaReader*  r )
+{
+    if (r->has_utc_offset)
+        return nmea_elapsed_ms() + r->utc_offset;
 
-    r->utc_diff = time_utc - time_local;
+    return gps_clock_ms( CLOCK_REALTIME );
 }
 
 
 static void
 nmea_reader_init( NmeaReader*  r )
 {
+    char  checksum[PROPERTY_VALUE_MAX];
+    char  suppress[PROPERTY_VALUE_MAX];
+    int   keepalive, n;
+
     memset( r, 0, sizeof(*r) );
 
+    // empty fields until the first GGA or RMC sentence
+    for (n = 0; n < (int)(sizeof(r->tokens) / sizeof(Token)); n++) {
+        Token*  tok = (Token*)&r->tokens + n;
+        tok->p = tok->end = tok->buff;
+    }
+
     r->pos      = 0;
     r->overflow = 0;
     r->utc_year = -1;
@@ -241,36 +405,187 @@ nmea_reader_init( NmeaReader*  r )
     r->callback = NULL;
     r->fix.size = sizeof(r->fix);
 
-    nmea_reader_update_utc_diff( r );
+    property_get(GPS_CHECKSUM_PROPERTY, checksum, GPS_CHECKSUM_STRICT);
+    r->check_checksum = strcmp(checksum, GPS_CHECKSUM_IGNORE) != 0;
+    r->last_fix.size = sizeof(r->last_fix);
+
+    property_get(GPS_SUPPRESS_PROPERTY, suppress, "");
+    keepalive = GPS_SUPPRESS_DEFAULT_KEEPALIVE;
+    if (sscanf(suppress, "%lf,%d", &r->suppress_m, &keepalive) < 1 || r->suppress_m < 0)
+        r->suppress_m = 0;
+    r->keepalive_ms = keepalive * 1000LL;
+    if (r->suppress_m > 0)
+        ALOGI("suppressing fixes within %gm, keep-alive %ds", r->suppress_m, keepalive);
+}
+
+
+/* drop any partially received sentence, used when the byte stream
+ * is interrupted so that two connections never get spliced together */
+static void
+nmea_reader_reset_line( NmeaReader*  r )
+{
+    r->pos      = 0;
+    r->overflow = 0;
+}
+
+
+static void
+nmea_reader_deliver( NmeaReader*  r )
+{
+    r->callback( &r->fix );
+    r->last_fix     = r->fix;
+    r->fix.flags    = 0;
+    r->delivered_ms = nmea_elapsed_ms();
+}
+
+
+/* true when the pending fix tells the framework nothing new: nothing it
+ * has that the last delivered fix did not, a move below suppress_m, the
+ * same accuracy, bearing and speed, and the keep-alive not yet due */
+static int
+nmea_reader_unchanged( NmeaReader*  r )
+{
+    const GpsLocation*  f = &r->fix;
+    const GpsLocation*  l = &r->last_fix;
+
+    if (r->suppress_m <= 0 || l->flags == 0 || (f->flags & ~l->flags) != 0)
+        return 0;
+
+    if (nmea_elapsed_ms() - r->delivered_ms >= r->keepalive_ms)
+        return 0;
+
+    if ((f->flags & GPS_LOCATION_HAS_ACCURACY) && f->accuracy != l->accuracy)
+        return 0;
+    if ((f->flags & GPS_LOCATION_HAS_BEARING) && f->bearing != l->bearing)
+        return 0;
+    if ((f->flags & GPS_LOCATION_HAS_SPEED) && f->speed != l->speed)
+        return 0;
+    if ((f->flags & GPS_LOCATION_HAS_ALTITUDE) && fabs(f->altitude - l->altitude) >= r->suppress_m)
+        return 0;
+
+    if (f->flags & GPS_LOCATION_HAS_LAT_LONG) {
+        // flat earth, fine at the scale of a few metres
+        double  dlon  = f->longitude - l->longitude;
+        double  north, east;
+
+        if (dlon > 180.)
+            dlon -= 360.;
+        else if (dlon < -180.)
+            dlon += 360.;
+        north = (f->latitude - l->latitude) * GPS_METERS_PER_DEG;
+        east  = dlon * GPS_METERS_PER_DEG * cos( f->latitude * (M_PI / 180.) );
+        if (north*north + east*east >= r->suppress_m * r->suppress_m)
+            return 0;
+    }
+    return 1;
+}
+
+
+/* send the last delivered fix again, so that the framework has a position
+ * right away after a reconnection instead of waiting for the next sentence */
+static void
+nmea_reader_replay( NmeaReader*  r )
+{
+    if (r->callback != NULL && r->last_fix.flags != 0) {
+        D("%s: replaying last fix", __FUNCTION__);
+        r->callback( &r->last_fix );
+    }
 }
 
 
+/* a new callback gets the latest fix at once: the pending one if any,
+ * else the last delivered one */
 static void
 nmea_reader_set_callback( NmeaReader*  r, gps_location_callback  cb )
 {
     r->callback = cb;
-    if (cb != NULL && r->fix.flags != 0) {
+    if (cb == NULL)
+        return;
+
+    if (r->fix.flags != 0) {
         D("%s: sending latest fix to new callback", __FUNCTION__);
-        r->callback( &r->fix );
-        r->fix.flags = 0;
+        nmea_reader_deliver( r );
     }
+    else
+        nmea_reader_replay( r );
+}
+
+
+/* use a fix that does not come from local_gps until the first one that
+ * does. a fix received from local_gps is never replaced, a seeded one
+ * only by a newer one */
+static void
+nmea_reader_seed( NmeaReader*  r, const GpsLocation*  fix )
+{
+    const GpsLocation*  cur = (r->fix.flags != 0) ? &r->fix : &r->last_fix;
+
+    if (cur->flags != 0 && (!r->seeded || fix->timestamp <= cur->timestamp))
+        return;
+
+    D("%s: seeding lat=%g lon=%g", __FUNCTION__, fix->latitude, fix->longitude);
+    r->seeded = 1;
+    r->fix    = *fix;
+    if (r->callback != NULL)
+        nmea_reader_deliver( r );
+}
+
+
+static void
+nmea_reader_inject_time( NmeaReader*  r, GpsUtcTime  time, int64_t  reference )
+{
+    r->utc_offset     = time - reference;
+    r->has_utc_offset = 1;
+}
+
+
+static void
+nmea_reader_inject_location( NmeaReader*  r, double  latitude, double  longitude,
+                             float  accuracy )
+{
+    GpsLocation  fix;
+
+    memset( &fix, 0, sizeof(fix) );
+    fix.size      = sizeof(fix);
+    fix.flags     = GPS_LOCATION_HAS_LAT_LONG | GPS_LOCATION_HAS_ACCURACY;
+    fix.latitude  = latitude;
+    fix.longitude = longitude;
+    fix.accuracy  = accuracy;
+    fix.timestamp = nmea_reader_utc_ms( r );
+
+    nmea_reader_seed( r, &fix );
 }
 
 
+/* milliseconds of a hhmmss.sss time, digits past the third are ignored */
+static int
+nmea_time_millis( const char*  p, const char*  end )
+{
+    int  millis = 0;
+    int  scale  = 100;
+
+    if (p >= end || *p != '.')
+        return 0;
+
+    for (p++; p < end && scale > 0; p++, scale /= 10) {
+        if ((unsigned)(*p - '0') > 9)
+            break;
+        millis += (*p - '0') * scale;
+    }
+    return millis;
+}
+
 static int
 nmea_reader_update_time( NmeaReader*  r, Token*  tok )
 {
-    int        hour, minute;
-    double     seconds;
+    int        hour, minute, seconds, millis;
     struct tm  tm;
-    time_t     fix_time;
 
     if (!tok->init || tok->p + 6 > tok->end)
         return -1;
 
     if (r->utc_year < 0) {
         // no date yet, get current one
-        time_t  now = time(NULL);
+        time_t  now = nmea_reader_utc_ms( r ) / 1000;
         gmtime_r( &now, &tm );
         r->utc_year = tm.tm_year + 1900;
         r->utc_mon  = tm.tm_mon + 1;
@@ -279,18 +594,11 @@ nmea_reader_update_time( NmeaReader*  r, Token*  tok )
 
     hour    = str2int(tok->p,   tok->p+2);
     minute  = str2int(tok->p+2, tok->p+4);
-    seconds = str2float(tok->p+4, tok->end);
-
-    tm.tm_hour  = hour;
-    tm.tm_min   = minute;
-    tm.tm_sec   = (int) seconds;
-    tm.tm_year  = r->utc_year - 1900;
-    tm.tm_mon   = r->utc_mon - 1;
-    tm.tm_mday  = r->utc_day;
-    tm.tm_isdst = -1;
-
-    fix_time = mktime( &tm ) + r->utc_diff;
-    r->fix.timestamp = (long long)fix_time * 1000;
+    seconds = str2int(tok->p+4, tok->p+6);
+    millis  = nmea_time_millis(tok->p+6, tok->end);
+
+    r->fix.timestamp = nmea_utc_seconds( r->utc_year, r->utc_mon, r->utc_day,
+                                         hour, minute, seconds ) * 1000 + millis;
     return 0;
 }
 
@@ -321,14 +629,42 @@ nmea_reader_update_date( NmeaReader*  r, Token* date, Token* time )
 }
 
 
-static double
-convert_from_hhmm( Token* tok )
+/* convert a NMEA 'dddmm.mmmm' coordinate to nano-degrees (GPS_COORD_SCALE)
+ * with integer arithmetic only, so no precision is lost before the final
+ * conversion to the double expected by the framework. returns -1 if
+ * malformed */
+static int
+convert_from_hhmm( Token* tok, long long*  coord )
 {
-    double  val     = str2float(tok->p, tok->end);
-    int     degrees = (int)(floor(val) / 100);
-    double  minutes = val - degrees*100.;
-    double  dcoord  = degrees + minutes / 60.0;
-    return dcoord;
+    const char*  p    = tok->p;
+    const char*  end  = tok->end;
+    const char*  dot  = (const char*) memchr(p, '.', end - p);
+    long long    frac = 0;
+    long long    unit = 1;
+    int          ddmm;
+
+    if (dot == NULL)
+        dot = end;
+
+    ddmm = str2int(p, dot);
+    if (ddmm < 0)
+        return -1;
+
+    if (dot < end) {
+        for (p = dot + 1; p < end && unit < 10000000LL; p++) {
+            int  c = *p - '0';
+            if ((unsigned)c >= 10)
+                return -1;
+            frac  = frac*10 + c;
+            unit *= 10;
+        }
+    }
+
+    // minutes in units of 1/unit, then nano-degrees rounded to the nearest
+    frac += (long long)(ddmm % 100) * unit;
+    *coord = (long long)(ddmm / 100) * GPS_COORD_SCALE +
+             (frac * GPS_COORD_SCALE + 30 * unit) / (60 * unit);
+    return 0;
 }
 
 
@@ -339,31 +675,28 @@ nmea_reader_update_latlong( NmeaReader*  r,
                             Token*       longitude,
                             char         longitudeHemi )
 {
-    double   lat, lon;
-    Token*   tok;
+    long long  lat, lon;
+    Token*     tok;
 
-    D("test");
     tok = latitude;
-    if (!tok->init || tok->p + 6 > tok->end) {
+    if (!tok->init || tok->p + 6 > tok->end || convert_from_hhmm(tok, &lat) < 0) {
         D("latitude is too short: '%.*s'", tok->end-tok->p, tok->p);
         return -1;
     }
-    lat = convert_from_hhmm(tok);
     if (latitudeHemi == 'S')
         lat = -lat;
 
     tok = longitude;
-    if (!tok->init || tok->p + 6 > tok->end) {
+    if (!tok->init || tok->p + 6 > tok->end || convert_from_hhmm(tok, &lon) < 0) {
         D("longitude is too short: '%.*s'", tok->end-tok->p, tok->p);
         return -1;
     }
-    lon = convert_from_hhmm(tok);
     if (longitudeHemi == 'W')
         lon = -lon;
 
     r->fix.flags    |= GPS_LOCATION_HAS_LAT_LONG;
-    r->fix.latitude  = lat;
-    r->fix.longitude = lon;
+    r->fix.latitude  = (double)lat / GPS_COORD_SCALE;
+    r->fix.longitude = (double)lon / GPS_COORD_SCALE;
     return 0;
 }
 
@@ -433,21 +766,36 @@ nmea_reader_update_accuracy( NmeaReader*  r, Token* tok )
 }
 
 
-static void
-nmea_reader_parse( NmeaReader*  r )
+/* update the pending fix from a complete sentence. returns -1 if the
+ * sentence is rejected for its checksum, else 1 when the pending fix has
+ * something to report, 0 when it has not */
+static int
+nmea_reader_update( NmeaReader*  r, const char*  line, const char*  end )
 {
-   /* we received a complete sentence, now parse it to generate
-    * a new GPS fix...
-    */
     NmeaTokenizer  tzer[1];
+    t_all_tokens*  t = &r->tokens;
 
-    D("Received: '%.*s'", r->pos, r->in);
-    if (r->pos < 9) {
+    D("Received: '%.*s'", end - line, line);
+    if (end - line < 9) {
         D("Too short. discarded.");
-        return;
+        return 0;
+    }
+
+    // a line spliced after an overflow or a transmission error ends here
+    if (r->check_checksum && !nmea_checksum_valid(line, end))
+        return -1;
+
+    // only names trace events, see gps_state_thread()
+    if (!memcmp(line, GPS_TRACE_SENTENCE, sizeof(GPS_TRACE_SENTENCE)-1))
+        return 0;
+
+    // the first sentence from local_gps replaces a seeded fix entirely
+    if (r->seeded) {
+        r->seeded    = 0;
+        r->fix.flags = 0;
     }
 
-    nmea_tokenizer_init(tzer, r->in, r->in + r->pos);
+    nmea_tokenizer_init(tzer, line, end);
 #if GPS_DEBUG
     {
         int  n;
@@ -464,34 +812,34 @@ nmea_reader_parse( NmeaReader*  r )
 
     if (tok.p + 5 > tok.end) {
         D("sentence id '%.*s' too short, ignored.", tok.end-tok.p, tok.p);
-        return;
+        return 0;
     }
 
     // ignore first two characters.
     tok.p += 2;
     if ( !memcmp(tok.p, "GGA", 3) ) {
         // GPS fix
-        nmea_tokenizer_get(tzer, 1, &tokens.time);
-        nmea_tokenizer_get(tzer, 2, &tokens.fixStatus);
-        nmea_tokenizer_get(tzer, 3, &tokens.latitude);
-        nmea_tokenizer_get(tzer, 4, &tokens.latitudeHemi);
-        nmea_tokenizer_get(tzer, 5, &tokens.longitude);
-        nmea_tokenizer_get(tzer, 6, &tokens.longitudeHemi);
-        nmea_tokenizer_get(tzer, 8, &tokens.accuracy);
-        nmea_tokenizer_get(tzer, 9, &tokens.altitude);
-        nmea_tokenizer_get(tzer, 10, &tokens.altitudeUnits);
+        nmea_tokenizer_get(tzer, 1, &t->time);
+        nmea_tokenizer_get(tzer, 2, &t->fixStatus);
+        nmea_tokenizer_get(tzer, 3, &t->latitude);
+        nmea_tokenizer_get(tzer, 4, &t->latitudeHemi);
+        nmea_tokenizer_get(tzer, 5, &t->longitude);
+        nmea_tokenizer_get(tzer, 6, &t->longitudeHemi);
+        nmea_tokenizer_get(tzer, 8, &t->accuracy);
+        nmea_tokenizer_get(tzer, 9, &t->altitude);
+        nmea_tokenizer_get(tzer, 10, &t->altitudeUnits);
     } else if ( !memcmp(tok.p, "GSA", 3) ) {
         // do something ?
     } else if ( !memcmp(tok.p, "RMC", 3) ) {
-        nmea_tokenizer_get(tzer, 1, &tokens.time);
-        nmea_tokenizer_get(tzer, 2, &tokens.fixStatus);
-        nmea_tokenizer_get(tzer, 3, &tokens.latitude);
-        nmea_tokenizer_get(tzer, 4, &tokens.latitudeHemi);
-        nmea_tokenizer_get(tzer, 5, &tokens.longitude);
-        nmea_tokenizer_get(tzer, 6, &tokens.longitudeHemi);
-        nmea_tokenizer_get(tzer, 7, &tokens.speed);
-        nmea_tokenizer_get(tzer, 8, &tokens.bearing);
-        nmea_tokenizer_get(tzer, 9, &tokens.date);
+        nmea_tokenizer_get(tzer, 1, &t->time);
+        nmea_tokenizer_get(tzer, 2, &t->fixStatus);
+        nmea_tokenizer_get(tzer, 3, &t->latitude);
+        nmea_tokenizer_get(tzer, 4, &t->latitudeHemi);
+        nmea_tokenizer_get(tzer, 5, &t->longitude);
+        nmea_tokenizer_get(tzer, 6, &t->longitudeHemi);
+        nmea_tokenizer_get(tzer, 7, &t->speed);
+        nmea_tokenizer_get(tzer, 8, &t->bearing);
+        nmea_tokenizer_get(tzer, 9, &t->date);
         D("in RMC, fixStatus=%c", tok_fixStatus.p[0]);
     } else {
         tok.p -= 2;
@@ -499,20 +847,40 @@ nmea_reader_parse( NmeaReader*  r )
     }
 
     // Always update everything
-    nmea_reader_update_time(r, &tokens.time);
+    nmea_reader_update_time(r, &t->time);
     nmea_reader_update_latlong(r,
-                               &tokens.latitude, tokens.latitudeHemi.p[0],
-                               &tokens.longitude, tokens.longitudeHemi.p[0]);
-    nmea_reader_update_altitude(r, &tokens.altitude, &tokens.altitudeUnits);
-    nmea_reader_update_accuracy(r, &tokens.accuracy);
+                               &t->latitude, t->latitudeHemi.p[0],
+                               &t->longitude, t->longitudeHemi.p[0]);
+    nmea_reader_update_altitude(r, &t->altitude, &t->altitudeUnits);
+    nmea_reader_update_accuracy(r, &t->accuracy);
+
+    if (t->fixStatus.init && t->fixStatus.p[0] == 'A') {
+        nmea_reader_update_date(r, &t->date, &t->time);
+        nmea_reader_update_bearing(r, &t->bearing);
+        nmea_reader_update_speed(r, &t->speed);
+    }
+
+    return r->fix.flags != 0;
+}
+
+
+static void
+nmea_reader_parse( NmeaReader*  r, const char*  line, const char*  end )
+{
+   /* we received a complete sentence, now parse it to generate
+    * a new GPS fix...
+    */
+    int  ret = nmea_reader_update( r, line, end );
 
-    if (tokens.fixStatus.init && tokens.fixStatus.p[0] == 'A') {
-        nmea_reader_update_date(r, &tokens.date, &tokens.time);
-        nmea_reader_update_bearing(r, &tokens.bearing);
-        nmea_reader_update_speed(r, &tokens.speed);
+    if (ret < 0) {
+        r->rejected += 1;
+        if (r->rejected == 1 || r->rejected % 100 == 0)
+            ALOGW("bad NMEA checksum, %u sentences rejected so far", r->rejected);
+        D("bad checksum: '%.*s'", end - line, line);
+        return;
     }
 
-    if (r->fix.flags != 0) {
+    if (ret > 0) {
 #if GPS_DEBUG
         char   temp[256];
         char*  p   = temp;
@@ -539,9 +907,15 @@ nmea_reader_parse( NmeaReader*  r )
         p += snprintf(p, end-p, " time=%s", asctime( &utc ) );
         D(temp);
 #endif
-        if (r->callback) {
-            r->callback( &r->fix );
-            r->fix.flags = 0;
+        geofence_update( &r->fix );
+        gps_last_fix_save( &r->fix );
+
+        if (r->callback && nmea_reader_unchanged( r )) {
+            r->suppressed += 1;
+            D("fix unchanged, not delivered (%u so far)", r->suppressed);
+        }
+        else if (r->callback) {
+            nmea_reader_deliver( r );
         }
         else {
             D("no callback, keeping data until needed !");
@@ -568,78 +942,445 @@ nmea_reader_addc( NmeaReader*  r, int  c )
     r->pos       += 1;
 
     if (c == '\n') {
-        nmea_reader_parse( r );
+        nmea_reader_parse( r, r->in, r->in + r->pos );
         r->pos = 0;
     }
 }
 
 
+/* parse a message received on the local seqpacket socket. message
+ * boundaries are kept by the kernel and a message only holds complete
+ * sentences, so lines are parsed in place without going through
+ * nmea_reader_addc() */
+static void
+nmea_reader_add_message( NmeaReader*  r, const char*  p, int  len )
+{
+    const char*  end = p + len;
+
+    while (p < end) {
+        const char*  q = (const char*) memchr(p, '\n', end - p);
+
+        q = (q == NULL) ? end : q + 1;
+        if (q - p <= NMEA_MAX_SIZE)
+            nmea_reader_parse( r, p, q );
+        else
+            D("sentence too long (%d bytes), discarded", (int)(q - p));
+        p = q;
+    }
+}
+
+
+/* offline parser, see gps_goby.hpp */
+struct NmeaParser {
+    NmeaReader  reader;
+};
+
+NmeaParser*
+nmea_parser_new( void )
+{
+    NmeaParser*  p = (NmeaParser*) malloc( sizeof(NmeaParser) );
+
+    if (p != NULL)
+        nmea_reader_init( &p->reader );
+    return p;
+}
+
+void
+nmea_parser_free( NmeaParser*  p )
+{
+    free( p );
+}
+
+int
+nmea_parser_sentence( NmeaParser*  p, const char*  line, const char*  end,
+                      GpsLocation*  fix )
+{
+    NmeaReader*  r = &p->reader;
+    int          ret;
+
+    if (end - line > NMEA_MAX_SIZE)
+        return 0;
+
+    ret = nmea_reader_update( r, line, end );
+    if (ret > 0) {
+        *fix         = r->fix;
+        r->fix.flags = 0;
+    }
+    return ret;
+}
+
+
 /*****************************************************************/
 /*****************************************************************/
 /*****                                                       *****/
-/*****       C O N N E C T I O N   S T A T E                 *****/
+/*****       D E L I V E R Y   Q U E U E                     *****/
 /*****                                                       *****/
 /*****************************************************************/
 /*****************************************************************/
 
-/* commands sent to the gps thread */
-enum {
-    CMD_QUIT  = 0,
-    CMD_START = 1,
-    CMD_STOP  = 2
-};
-
+/* fixes are handed to the framework by a delivery thread, so that a slow
+ * location callback never stalls the gps thread reading the socket.
+ *
+ * the queue is a ring with a single producer (the gps thread) and a single
+ * consumer (the delivery thread), without locks: the producer owns 'head',
+ * the consumer takes fixes by advancing 'tail' with a compare-and-swap.
+ * the producer never waits:
+ *  - latest-wins: when the ring is full, the producer drops the oldest fix
+ *    by advancing 'tail' itself. a copy the consumer was making of it then
+ *    fails its compare-and-swap and is retried. the consumer only delivers
+ *    the newest of the fixes it finds queued.
+ *  - keep-all: every fix is delivered in order, when the ring is full the
+ *    new one is dropped.
+ * dropped fixes are counted.
+ */
+#define  GPS_DELIVERY_QUEUE_SIZE  16    /* power of 2 */
 
-/* this is the state of our connection to the qemu_gpsd daemon */ 
 typedef struct {
-    int                     init;
-    int                     fd;
-    GpsCallbacks            callbacks;
-    pthread_t               thread;
-    int                     control[2];
-} GpsState;
-
-static GpsState  _gps_state[1];
+    GpsLocation             slots[ GPS_DELIVERY_QUEUE_SIZE ];
+    unsigned                seqs[ GPS_DELIVERY_QUEUE_SIZE ];    /* trace events */
+    unsigned                head;
+    unsigned                tail;
+    unsigned                drops;
+    int                     latest_wins;
+    int                     quit;
+    int                     event_fd;
+    gps_location_callback   callback;
+} GpsDelivery;
 
 
 static void
-gps_state_done( GpsState*  s )
+gps_delivery_push( GpsDelivery*  q, const GpsLocation*  fix, unsigned  seq )
 {
-    char   cmd = CMD_QUIT;
-    write( s->control[0], &cmd, 1 );
+    unsigned  head = q->head;
+    unsigned  tail = __atomic_load_n( &q->tail, __ATOMIC_ACQUIRE );
+    uint64_t  one  = 1;
+
+    if (head - tail == GPS_DELIVERY_QUEUE_SIZE) {
+        if (!q->latest_wins) {
+            q->drops++;
+            D("%s: queue full, fix dropped (%u so far)", __FUNCTION__, q->drops);
+            return;
+        }
+        // if this fails, the consumer just made room
+        if (__atomic_compare_exchange_n( &q->tail, &tail, tail + 1, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ))
+            q->drops++;
+    }
+
+    q->slots[ head & (GPS_DELIVERY_QUEUE_SIZE-1) ] = *fix;
+    q->seqs[ head & (GPS_DELIVERY_QUEUE_SIZE-1) ]  = seq;
+    __atomic_store_n( &q->head, head + 1, __ATOMIC_RELEASE );
+
+    // never blocks, the counter would need 2^64 fixes to fill
+    write( q->event_fd, &one, sizeof(one) );
 }
 
 
-static void
-gps_state_start( GpsState*  s )
+/* take the next fix to deliver, or the newest one in latest-wins mode.
+ * returns 0 when the queue is empty */
+static int
+gps_delivery_pop( GpsDelivery*  q, GpsLocation*  fix, unsigned*  seq )
 {
-    char  cmd = CMD_START;
-    int   ret;
+    for (;;) {
+        unsigned  tail = __atomic_load_n( &q->tail, __ATOMIC_ACQUIRE );
+        unsigned  head = __atomic_load_n( &q->head, __ATOMIC_ACQUIRE );
+        unsigned  pick;
 
-    do { ret=write( s->control[0], &cmd, 1 ); }
-    while (ret < 0 && errno == EINTR);
+        if (tail == head)
+            return 0;
 
-    if (ret != 1)
-        D("%s: could not send CMD_START command: ret=%d: %s",
-          __FUNCTION__, ret, strerror(errno));
+        pick  = q->latest_wins ? head - 1 : tail;
+        *fix  = q->slots[ pick & (GPS_DELIVERY_QUEUE_SIZE-1) ];
+        *seq  = q->seqs[ pick & (GPS_DELIVERY_QUEUE_SIZE-1) ];
+
+        // the copy is only valid if the producer did not recycle the slot
+        if (__atomic_compare_exchange_n( &q->tail, &tail, pick + 1, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ))
+            return 1;
+    }
 }
 
 
+/* drop the fixes still queued, called by the producer when the session
+ * stops. a fix the consumer already took is still delivered */
 static void
-gps_state_stop( GpsState*  s )
+gps_delivery_clear( GpsDelivery*  q )
 {
-    char  cmd = CMD_STOP;
-    int   ret;
-
-    do { ret=write( s->control[0], &cmd, 1 ); }
-    while (ret < 0 && errno == EINTR);
-
-    if (ret != 1)
-        D("%s: could not send CMD_STOP command: ret=%d: %s",
-          __FUNCTION__, ret, strerror(errno));
+    unsigned  head = q->head;
+    unsigned  tail = __atomic_load_n( &q->tail, __ATOMIC_ACQUIRE );
+
+    // if this fails, the consumer took some meanwhile and tail is reloaded
+    while (tail != head) {
+        if (__atomic_compare_exchange_n( &q->tail, &tail, head, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE )) {
+            q->drops += head - tail;
+            break;
+        }
+    }
 }
 
-static void gps_update_status(GpsState *state, GpsStatusValue val)
+
+static void
+gps_delivery_thread( void*  arg )
+{
+    GpsDelivery*  q = (GpsDelivery*) arg;
+    GpsLocation   fix;
+    unsigned      seq;
+    uint64_t      count;
+
+    D("gps delivery thread running");
+
+    for (;;) {
+        if (read( q->event_fd, &count, sizeof(count) ) < 0) {
+            if (errno != EINTR) {
+                ALOGE("gps delivery thread: read() unexpected error: %s", strerror(errno));
+                return;
+            }
+            continue;
+        }
+
+        if (__atomic_load_n( &q->quit, __ATOMIC_ACQUIRE )) {
+            D("gps delivery thread quitting");
+            return;
+        }
+
+        while (gps_delivery_pop( q, &fix, &seq )) {
+            GPS_TRACE_BEGIN( "gps location_cb", seq );
+            q->callback( &fix );
+            GPS_TRACE_END();
+        }
+    }
+}
+
+
+static int
+gps_delivery_init( GpsDelivery*  q, gps_location_callback  callback )
+{
+    char  policy[PROPERTY_VALUE_MAX];
+
+    property_get(GPS_DELIVERY_PROPERTY, policy, GPS_DELIVERY_LATEST);
+
+    q->head        = 0;
+    q->tail        = 0;
+    q->drops       = 0;
+    q->latest_wins = strcmp(policy, GPS_DELIVERY_ALL) != 0;
+    q->quit        = 0;
+    q->callback    = callback;
+    q->event_fd    = eventfd( 0, 0 );
+
+    if (q->event_fd < 0) {
+        ALOGE("could not create delivery eventfd: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+/* stop and join the delivery thread, fixes still queued are dropped */
+static void
+gps_delivery_done( GpsDelivery*  q, pthread_t  thread )
+{
+    uint64_t  one = 1;
+
+    __atomic_store_n( &q->quit, 1, __ATOMIC_RELEASE );
+    write( q->event_fd, &one, sizeof(one) );
+    pthread_join( thread, NULL );
+
+    close( q->event_fd );
+    q->event_fd = -1;
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       C O N N E C T I O N   S T A T E                 *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* commands sent to the gps thread */
+enum {
+    CMD_QUIT  = 0,
+    CMD_START = 1,
+    CMD_STOP  = 2,
+    CMD_INJECT_TIME     = 3,    /* followed by a GpsInjectedTime */
+    CMD_INJECT_LOCATION = 4,    /* followed by a GpsInjectedLocation */
+    CMD_GEOFENCE        = 5     /* the monitored geofences changed */
+};
+
+typedef struct {
+    GpsUtcTime  time;
+    int64_t     reference;
+} GpsInjectedTime;
+
+typedef struct {
+    double  latitude;
+    double  longitude;
+    float   accuracy;
+} GpsInjectedLocation;
+
+
+/* delays between two connection attempts to local_gps, doubled after
+ * each failure and reset once a connection is established */
+#define  GPS_RECONNECT_MIN_MS   100
+#define  GPS_RECONNECT_MAX_MS   5000
+
+/* this is the state of our connection to the qemu_gpsd daemon */ 
+typedef struct {
+    int                     init;
+    int                     fd;
+    int                     local;
+    int                     connected;
+    int                     session;    /* last session sent, -1 if none */
+    int                     backoff_ms;
+    long long               reconnect_at;
+    GpsCallbacks            callbacks;
+    pthread_t               thread;
+    pthread_t               delivery_thread;
+    GpsDelivery             delivery;
+    unsigned                trace_seq;  /* of the message being parsed */
+    int                     control[2];
+} GpsState;
+
+static GpsState  _gps_state[1];
+
+
+/* location callback of the nmea reader, runs on the gps thread */
+static void
+gps_state_post_location( GpsLocation*  fix )
+{
+    gps_delivery_push( &_gps_state->delivery, fix, _gps_state->trace_seq );
+}
+
+
+static long long
+gps_now_ms( void )
+{
+    struct timespec  ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* stop the gps thread, then the delivery thread it was feeding */
+static void
+gps_state_done( GpsState*  s )
+{
+    char   cmd = CMD_QUIT;
+    void*  dummy;
+    int    ret;
+
+    do { ret=write( s->control[0], &cmd, 1 ); }
+    while (ret < 0 && errno == EINTR);
+
+    if (ret != 1)
+        ALOGE("%s: could not send CMD_QUIT command: ret=%d: %s",
+              __FUNCTION__, ret, strerror(errno));
+    else
+        pthread_join( s->thread, &dummy );
+
+    gps_delivery_done( &s->delivery, s->delivery_thread );
+
+    s->init = 0;
+    close( s->control[0] );
+    close( s->control[1] );
+    s->control[0] = -1;
+    s->control[1] = -1;
+}
+
+
+static void
+gps_state_start( GpsState*  s )
+{
+    char  cmd = CMD_START;
+    int   ret;
+
+    do { ret=write( s->control[0], &cmd, 1 ); }
+    while (ret < 0 && errno == EINTR);
+
+    if (ret != 1)
+        D("%s: could not send CMD_START command: ret=%d: %s",
+          __FUNCTION__, ret, strerror(errno));
+}
+
+
+static void
+gps_state_stop( GpsState*  s )
+{
+    char  cmd = CMD_STOP;
+    int   ret;
+
+    do { ret=write( s->control[0], &cmd, 1 ); }
+    while (ret < 0 && errno == EINTR);
+
+    if (ret != 1)
+        D("%s: could not send CMD_STOP command: ret=%d: %s",
+          __FUNCTION__, ret, strerror(errno));
+}
+
+/* see gps_geofence.hpp, the gps thread tells local_gps if the session
+ * must now be kept started for the geofences */
+void
+gps_geofence_changed( void )
+{
+    GpsState*  s = _gps_state;
+    char       cmd = CMD_GEOFENCE;
+    int        ret;
+
+    if (!s->init)
+        return;
+
+    do { ret=write( s->control[0], &cmd, 1 ); }
+    while (ret < 0 && errno == EINTR);
+
+    if (ret != 1)
+        D("%s: could not send CMD_GEOFENCE command: ret=%d: %s",
+          __FUNCTION__, ret, strerror(errno));
+}
+
+
+/* send a command and its argument to the gps thread. a single write keeps
+ * them together when several threads send commands */
+static void
+gps_state_inject( GpsState*  s, char  cmd, const void*  data, size_t  size )
+{
+    char  buff[ 1 + sizeof(GpsInjectedLocation) ];    /* largest argument */
+    int   ret;
+
+    buff[0] = cmd;
+    memcpy( buff + 1, data, size );
+
+    do { ret=write( s->control[0], buff, 1 + size ); }
+    while (ret < 0 && errno == EINTR);
+
+    if (ret != (int)(1 + size))
+        D("%s: could not send command %d: ret=%d: %s",
+          __FUNCTION__, cmd, ret, strerror(errno));
+}
+
+
+/* read the argument of a command from the control socket */
+static int
+gps_control_read( int  fd, void*  data, size_t  size )
+{
+    char*  p = (char*) data;
+
+    while (size > 0) {
+        int  ret = read( fd, p, size );
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        p    += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+
+static void gps_update_status(GpsState *state, GpsStatusValue val)
 {
     if (state && state->callbacks.status_cb) {
         GpsStatus status;
@@ -654,7 +1395,7 @@ static void gps_update_status(GpsState *state, GpsStatusValue val)
 }
 
 static int
-epoll_register( int  epoll_fd, int  fd )
+epoll_register_events( int  epoll_fd, int  fd, uint32_t  events )
 {
     struct epoll_event  ev;
     int                 ret, flags;
@@ -663,7 +1404,7 @@ epoll_register( int  epoll_fd, int  fd )
     flags = fcntl(fd, F_GETFL);
     fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 
-    ev.events  = EPOLLIN;
+    ev.events  = events;
     ev.data.fd = fd;
     do {
         ret = epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &ev );
@@ -672,6 +1413,28 @@ epoll_register( int  epoll_fd, int  fd )
 }
 
 
+static int
+epoll_register( int  epoll_fd, int  fd )
+{
+    return epoll_register_events( epoll_fd, fd, EPOLLIN );
+}
+
+
+static int
+epoll_modify( int  epoll_fd, int  fd, uint32_t  events )
+{
+    struct epoll_event  ev;
+    int                 ret;
+
+    ev.events  = events;
+    ev.data.fd = fd;
+    do {
+        ret = epoll_ctl( epoll_fd, EPOLL_CTL_MOD, fd, &ev );
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+
 static int
 epoll_deregister( int  epoll_fd, int  fd )
 {
@@ -682,25 +1445,168 @@ epoll_deregister( int  epoll_fd, int  fd )
     return ret;
 }
 
+
+/* plan the next connection attempt, with exponential backoff */
+static void
+gps_state_schedule_reconnect( GpsState*  s )
+{
+    s->reconnect_at = gps_now_ms() + s->backoff_ms;
+    D("reconnecting to local_gps in %d ms", s->backoff_ms);
+
+    s->backoff_ms *= 2;
+    if (s->backoff_ms > GPS_RECONNECT_MAX_MS)
+        s->backoff_ms = GPS_RECONNECT_MAX_MS;
+}
+
+
+/* start a non-blocking connection to local_gps. the socket is watched
+ * for EPOLLOUT until the connection completes, see gps_state_connected() */
+static int
+gps_state_connect( GpsState*  s, int  epoll_fd )
+{
+    struct sockaddr_in  tcp_server;
+    struct sockaddr_un  local_server;
+    struct sockaddr*    addr;
+    socklen_t           addr_len;
+    int                 fd, ret;
+
+    if (s->local) {
+        // abstract namespace: sun_path starts with a NUL byte
+        memset(&local_server, 0, sizeof(local_server));
+        local_server.sun_family = AF_LOCAL;
+        strcpy(local_server.sun_path + 1, GPS_SOCKET_NAME);
+        addr     = (struct sockaddr *)&local_server;
+        addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(GPS_SOCKET_NAME);
+        fd       = socket(AF_LOCAL, SOCK_SEQPACKET, 0);
+    } else {
+        memset(&tcp_server, 0, sizeof(tcp_server));
+        tcp_server.sin_family = AF_INET;
+        tcp_server.sin_addr.s_addr = inet_addr("127.0.0.1");
+        tcp_server.sin_port = htons(GPS_PORT);
+        addr     = (struct sockaddr *)&tcp_server;
+        addr_len = sizeof(tcp_server);
+        fd       = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    }
+
+    if (fd < 0) {
+        ALOGE("unable to create gps socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (epoll_register_events( epoll_fd, fd, EPOLLOUT ) < 0) {
+        ALOGE("unable to register gps socket: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    do {
+        ret = connect(fd, addr, addr_len);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno != EINPROGRESS) {
+        D("unable to connect to local_gps: %s", strerror(errno));
+        epoll_deregister( epoll_fd, fd );
+        close(fd);
+        return -1;
+    }
+
+    s->fd        = fd;
+    s->connected = 0;
+    return 0;
+}
+
+
+static void
+gps_state_disconnect( GpsState*  s, int  epoll_fd )
+{
+    if (s->fd < 0)
+        return;
+
+    epoll_deregister( epoll_fd, s->fd );
+    close( s->fd );
+    s->fd        = -1;
+    s->connected = 0;
+    gps_state_schedule_reconnect( s );
+}
+
+
+/* tell local_gps whether fixes are wanted, so it can idle otherwise.
+ * monitored geofences want them even when the framework does not */
+static void
+gps_state_send_session( GpsState*  s, int  started )
+{
+    int   wanted = started || geofence_monitoring() > 0;
+    char  cmd = wanted ? GPS_SESSION_START : GPS_SESSION_STOP;
+    int   ret;
+
+    if (!s->connected || wanted == s->session)
+        return;
+
+    do {
+        ret = send( s->fd, &cmd, 1, MSG_NOSIGNAL | MSG_DONTWAIT );
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != 1)
+        D("%s: could not send session command: %s", __FUNCTION__, strerror(errno));
+    else
+        s->session = wanted;
+}
+
+
+/* called when the pending connection is writable, returns 0 once the
+ * connection to local_gps is established */
+static int
+gps_state_connected( GpsState*  s, int  epoll_fd )
+{
+    int        err = 0;
+    socklen_t  len = sizeof(err);
+
+    if (getsockopt( s->fd, SOL_SOCKET, SO_ERROR, &err, &len ) < 0)
+        err = errno;
+
+    if (err != 0) {
+        D("unable to connect to local_gps: %s", strerror(err));
+        return -1;
+    }
+
+    epoll_modify( epoll_fd, s->fd, EPOLLIN );
+    s->connected  = 1;
+    s->session    = -1;
+    s->backoff_ms = GPS_RECONNECT_MIN_MS;
+    D("connected to local_gps (%s)", s->local ? "local socket" : "TCP");
+    return 0;
+}
+
+
 /* this is the main thread, it waits for commands from gps_state_start/stop and,
  * when started, messages from the QEMU GPS daemon. these are simple NMEA sentences
  * that must be parsed to be converted into GPS fixes sent to the framework
+ *
+ * the connection to local_gps is also owned by this thread: it is opened
+ * without blocking, and reopened with a backoff delay whenever it fails or
+ * local_gps goes away.
  */
 static void
 gps_state_thread( void*  arg )
 {
     GpsState*   state = (GpsState*) arg;
     NmeaReader  reader[1];
+    GpsLocation fix;
     int         epoll_fd   = epoll_create(2);
     int         started    = 0;
-    int         gps_fd     = state->fd;
     int         control_fd = state->control[1];
 
     nmea_reader_init( reader );
 
+    // until local_gps sends something, start from where we were
+    gps_last_fix_open();
+    if (gps_last_fix_load( &fix )) {
+        D("gps thread loaded last known fix");
+        nmea_reader_seed( reader, &fix );
+    }
+
     // register control file descriptors for polling
     epoll_register( epoll_fd, control_fd );
-    epoll_register( epoll_fd, gps_fd );
 
     D("gps thread running");
 
@@ -710,8 +1616,25 @@ gps_state_thread( void*  arg )
     for (;;) {
         struct epoll_event   events[2];
         int                  ne, nevents;
+        int                  timeout = -1, gtimeout;
+
+        if (state->fd < 0) {
+            long long  delay = state->reconnect_at - gps_now_ms();
 
-        nevents = epoll_wait( epoll_fd, events, 2, -1 );
+            if (delay <= 0) {
+                if (gps_state_connect( state, epoll_fd ) < 0)
+                    gps_state_schedule_reconnect( state );
+                continue;
+            }
+            timeout = (int) delay;
+        }
+
+        // geofences go uncertain when fixes stop coming
+        gtimeout = geofence_check();
+        if (gtimeout >= 0 && (timeout < 0 || gtimeout < timeout))
+            timeout = gtimeout;
+
+        nevents = epoll_wait( epoll_fd, events, 2, timeout );
         if (nevents < 0) {
             if (errno != EINTR)
                 ALOGE("epoll_wait() unexpected error: %s", strerror(errno));
@@ -719,15 +1642,110 @@ gps_state_thread( void*  arg )
         }
         D("gps thread received %d events", nevents);
         for (ne = 0; ne < nevents; ne++) {
-            if ((events[ne].events & (EPOLLERR|EPOLLHUP)) != 0) {
-                ALOGE("EPOLLERR or EPOLLHUP after epoll_wait() !?");
-                return;
-            }
-            if ((events[ne].events & EPOLLIN) != 0) {
-                int  fd = events[ne].data.fd;
+            int  fd = events[ne].data.fd;
+
+            if (fd == state->fd)
+            {
+                int  hangup = (events[ne].events & (EPOLLERR|EPOLLHUP)) != 0;
+
+                if (!state->connected) {
+                    if (hangup || gps_state_connected( state, epoll_fd ) < 0) {
+                        gps_state_disconnect( state, epoll_fd );
+                        continue;
+                    }
+                    gps_state_send_session( state, started );
+                    nmea_reader_reset_line( reader );
+                    nmea_reader_replay( reader );
+                    continue;
+                }
+
+                if ((events[ne].events & EPOLLIN) != 0 && state->local) {
+                    char           buff[GPS_MAX_MESSAGE_SIZE];
+                    struct iovec   iov;
+                    struct msghdr  msg;
+                    D("gps fd event");
+                    for (;;) {
+                        int  ret;
+
+                        iov.iov_base = buff;
+                        iov.iov_len  = sizeof(buff);
+                        memset(&msg, 0, sizeof(msg));
+                        msg.msg_iov    = &iov;
+                        msg.msg_iovlen = 1;
+
+                        ret = recvmsg(fd, &msg, 0);
+
+                        if (ret < 0) {
+                            if (errno == EINTR)
+                                continue;
+                            if (errno != EWOULDBLOCK) {
+                                ALOGE("error while reading from gps daemon socket: %s:", strerror(errno));
+                                hangup = 1;
+                            }
+                            break;
+                        }
+                        if (ret == 0) {
+                            hangup = 1;
+                            break;
+                        }
+                        if (msg.msg_flags & MSG_TRUNC) {
+                            D("truncated message discarded");
+                            continue;
+                        }
+                        D("received message of %d bytes: %.*s", ret, ret, buff);
+                        // with trace events on, local_gps starts the message
+                        // with the sequence number of its fix
+                        if (GPS_TRACE_ON()) {
+                            state->trace_seq = gps_trace_message_seq( buff, ret );
+                            GPS_TRACE_BEGIN( "gps recv", state->trace_seq );
+                            GPS_TRACE_END();
+                        }
+                        GPS_TRACE_BEGIN( "gps parse", state->trace_seq );
+                        nmea_reader_add_message( reader, buff, ret );
+                        GPS_TRACE_END();
+                    }
+                    D("gps fd event end");
+                }
+                else if ((events[ne].events & EPOLLIN) != 0) {
+                    char  buff[128];
+                    D("gps fd event");
+                    for (;;) {
+                        int  nn, ret;
+
+                        ret = recv(fd, buff, sizeof(buff), 0);
 
-                if (fd == control_fd)
-                {
+                        if (ret < 0) {
+                            if (errno == EINTR)
+                                continue;
+                            if (errno != EWOULDBLOCK) {
+                                ALOGE("error while reading from gps daemon socket: %s:", strerror(errno));
+                                hangup = 1;
+                            }
+                            break;
+                        }
+                        if (ret == 0) {
+                            hangup = 1;
+                            break;
+                        }
+                        D("received %d bytes: %.*s", ret, ret, buff);
+                        for (nn = 0; nn < ret; nn++)
+                            nmea_reader_addc( reader, buff[nn] );
+                    }
+                    D("gps fd event end");
+                }
+
+                if (hangup) {
+                    ALOGE("connection to local_gps lost, reconnecting");
+                    gps_state_disconnect( state, epoll_fd );
+                }
+            }
+            else if (fd == control_fd)
+            {
+                if ((events[ne].events & (EPOLLERR|EPOLLHUP)) != 0) {
+                    ALOGE("EPOLLERR or EPOLLHUP after epoll_wait() !?");
+                    return;
+                }
+                if ((events[ne].events & EPOLLIN) != 0) {
                     char  cmd = 255;
                     int   ret;
                     D("gps control fd event");
@@ -738,13 +1756,21 @@ gps_state_thread( void*  arg )
                     if (cmd == CMD_QUIT) {
                         D("gps thread quitting on demand");
                         gps_update_status(state, GPS_STATUS_ENGINE_OFF);
+                        gps_state_disconnect( state, epoll_fd );
+                        close( epoll_fd );
+                        return;
                     }
                     else if (cmd == CMD_START) {
                         if (!started) {
+                            char  trace[PROPERTY_VALUE_MAX];
+
                             D("gps thread starting  location_cb=%p", state->callbacks.location_cb);
                             started = 1;
+                            property_get(GPS_TRACE_PROPERTY, trace, "0");
+                            gps_trace_setup( strcmp(trace, "1") == 0 );
                             gps_update_status(state, GPS_STATUS_SESSION_BEGIN);
-                            nmea_reader_set_callback( reader, state->callbacks.location_cb );
+                            gps_state_send_session( state, started );
+                            nmea_reader_set_callback( reader, gps_state_post_location );
                         }
                     }
                     else if (cmd == CMD_STOP) {
@@ -752,40 +1778,36 @@ gps_state_thread( void*  arg )
                             D("gps thread stopping");
                             started = 0;
                             gps_update_status(state, GPS_STATUS_SESSION_END);
+                            gps_state_send_session( state, started );
                             nmea_reader_set_callback( reader, NULL );
+                            gps_delivery_clear( &state->delivery );
                         }
                     }
+                    else if (cmd == CMD_INJECT_TIME) {
+                        GpsInjectedTime  t;
+                        if (gps_control_read( fd, &t, sizeof(t) ) == 0) {
+                            D("gps thread injecting time %lld", (long long)t.time);
+                            nmea_reader_inject_time( reader, t.time, t.reference );
+                        }
+                    }
+                    else if (cmd == CMD_GEOFENCE) {
+                        gps_state_send_session( state, started );
+                    }
+                    else if (cmd == CMD_INJECT_LOCATION) {
+                        GpsInjectedLocation  l;
+                        if (gps_control_read( fd, &l, sizeof(l) ) == 0)
+                            nmea_reader_inject_location( reader, l.latitude, l.longitude,
+                                                         l.accuracy );
+                    }
                     else
                     {
                         D("Unknown GPS command '%c'", cmd);
                     }
                 }
-                else if (fd == gps_fd)
-                {
-                    char  buff[128];
-                    D("gps fd event");
-                    for (;;) {
-                        int  nn, ret;
-
-                        ret = recv(fd, buff, sizeof(buff), 0);
-
-                        if (ret < 0) {
-                            if (errno == EINTR)
-                                continue;
-                            if (errno != EWOULDBLOCK)
-                                ALOGE("error while reading from gps daemon socket: %s:", strerror(errno));
-                            break;
-                        }
-                        D("received %d bytes: %.*s", ret, ret, buff);
-                        for (nn = 0; nn < ret; nn++)
-                            nmea_reader_addc( reader, buff[nn] );
-                    }
-                    D("gps fd event end");
-                }
-                else
-                {
-                    ALOGE("epoll_wait() returned unkown fd %d ?", fd);
-                }
+            }
+            else
+            {
+                ALOGE("epoll_wait() returned unkown fd %d ?", fd);
             }
         }
     }
@@ -794,54 +1816,59 @@ gps_state_thread( void*  arg )
 
 static void gps_state_init(GpsState *state, GpsCallbacks *callbacks)
 {
-    state->init       = 1;
-    state->control[0] = -1;
-    state->control[1] = -1;
-    state->fd         = -1;
+    char  transport[PROPERTY_VALUE_MAX];
 
-    state->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (state->fd < 0) {
-        D("unable to create TCP socket");
-        return;
-    }
+    property_get(GPS_TRANSPORT_PROPERTY, transport, GPS_TRANSPORT_LOCAL);
+    gps_clock_setup();
 
-    struct sockaddr_in local_server;
-    local_server.sin_family = AF_INET;
-    local_server.sin_addr.s_addr = inet_addr("127.0.0.1");
-    local_server.sin_family = AF_INET;
-    local_server.sin_port = htons(GPS_PORT);
-    int i;
-    for (i=0;i<3;i++) {
-        if (!connect(state->fd, (struct sockaddr *)&local_server, sizeof(local_server)))
-            break;
-    }
-    if (i>=3) {
-        D("unable to connect to local TCP server");
-        state->fd = -1;
-        return;
-    }
-
-    D("connected to local TCP server");
+    state->init         = 1;
+    state->local        = strcmp(transport, GPS_TRANSPORT_TCP) != 0;
+    state->control[0]   = -1;
+    state->control[1]   = -1;
+    state->fd           = -1;
+    state->connected    = 0;
+    state->backoff_ms   = GPS_RECONNECT_MIN_MS;
+    state->reconnect_at = 0;
 
     if ( socketpair( AF_LOCAL, SOCK_STREAM, 0, state->control ) < 0 ) {
         ALOGE("could not create thread control socket pair: %s", strerror(errno));
         goto Fail;
     }
 
+    // the thread reads the callbacks as soon as it runs
+    state->callbacks = *callbacks;
+
+    if ( gps_delivery_init( &state->delivery, callbacks->location_cb ) < 0 )
+        goto Fail;
+
+    state->delivery_thread = callbacks->create_thread_cb( "gps_delivery_thread",
+                                                          gps_delivery_thread,
+                                                          &state->delivery );
+    if ( !state->delivery_thread ) {
+        ALOGE("could not create gps delivery thread: %s", strerror(errno));
+        close( state->delivery.event_fd );
+        goto Fail;
+    }
+
     state->thread = callbacks->create_thread_cb( "gps_state_thread", gps_state_thread, state );
 
     if ( !state->thread ) {
         ALOGE("could not create gps thread: %s", strerror(errno));
+        gps_delivery_done( &state->delivery, state->delivery_thread );
         goto Fail;
     }
 
-    state->callbacks = *callbacks;
-
     D("gps state initialized");
     return;
 
 Fail:
-    gps_state_done( state );
+    if (state->control[0] >= 0) {
+        close( state->control[0] );
+        close( state->control[1] );
+    }
+    state->control[0] = -1;
+    state->control[1] = -1;
+    state->init       = 0;
 }
 
 
@@ -862,7 +1889,8 @@ gps_init(GpsCallbacks* callbacks)
     if (!s->init)
         gps_state_init(s, callbacks);
 
-    if (s->fd < 0)
+    // the connection to local_gps is made asynchronously by the gps thread
+    if (!s->init)
         return -1;
 
     return 0;
@@ -912,11 +1940,30 @@ gps_stop()
 
 static int gps_inject_time(GpsUtcTime time, int64_t timeReference, int uncertainty)
 {
+    GpsState*        s = _gps_state;
+    GpsInjectedTime  t;
+
+    if (!s->init)
+        return -1;
+
+    t.time      = time;
+    t.reference = timeReference;
+    gps_state_inject( s, CMD_INJECT_TIME, &t, sizeof(t) );
     return 0;
 }
 
 static int gps_inject_location(double latitude, double longitude, float accuracy)
 {
+    GpsState*            s = _gps_state;
+    GpsInjectedLocation  l;
+
+    if (!s->init)
+        return -1;
+
+    l.latitude  = latitude;
+    l.longitude = longitude;
+    l.accuracy  = accuracy;
+    gps_state_inject( s, CMD_INJECT_LOCATION, &l, sizeof(l) );
     return 0;
 }
 
@@ -935,6 +1982,9 @@ static int gps_set_position_mode(GpsPositionMode mode,
 
 static const void *gps_get_extension(const char* name)
 {
+    if (name != NULL && strcmp(name, GPS_GEOFENCING_INTERFACE) == 0)
+        return &gpsGeofencingInterface;
+
     return NULL;
 }
 
@@ -968,9 +2018,6 @@ static int open_gps(const struct hw_module_t* module, char const* name,
     dev->get_gps_interface = gps__get_gps_interface;
 
     *device = (struct hw_device_t*)dev;
-
-    // Initialize tokens
-    memset(&tokens, 0, sizeof(tokens));
     return 0;
 }
 
@@ -1,6 +1,18 @@
 #ifndef GPS_GOBY_H_
 #define GPS_GOBY_H_
 
+#include <hardware/gps.h>
+
+#define  NMEA_MAX_SIZE  83
+
+typedef struct {
+
+    char buff[128];
+    int init;
+    char*  p;
+    char*  end;
+} Token;
+
 typedef struct s_all_tokens {
     Token time;
     Token latitude;
@@ -15,4 +27,19 @@ typedef struct s_all_tokens {
     Token bearing;
     Token date;
 } t_all_tokens;
+
+/* The NMEA parser of the HAL, for the tools that go through NMEA logs
+ * offline (gps_nmea_stats). A parser only has its own state, one can be
+ * used per thread. Fixes are returned instead of being delivered, they
+ * are not evaluated against the geofences nor persisted. */
+typedef struct NmeaParser NmeaParser;
+
+NmeaParser*  nmea_parser_new( void );
+void         nmea_parser_free( NmeaParser*  p );
+
+/* parse one sentence, from its '$' to its line end. returns -1 if it is
+ * rejected for its checksum, 1 when it completes a fix, copied to *fix,
+ * else 0. sentences longer than NMEA_MAX_SIZE are ignored */
+int          nmea_parser_sentence( NmeaParser*  p, const char*  line, const char*  end,
+                                   GpsLocation*  fix );
 #endif
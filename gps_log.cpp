@@ -0,0 +1,126 @@
+#define LOG_TAG "local_gps"
+#include <cutils/properties.h>
+
+#include <sys/errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gps.hpp"
+#include "gps_log.hpp"
+
+typedef struct {
+    long long time_ms;
+    int level;
+    char msg[GPS_LOG_RING_MSG_SIZE];
+} gps_log_entry;
+
+int gps_log_ring_enabled;
+
+static gps_log_entry ring[GPS_LOG_RING_SIZE];
+static unsigned ring_next;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long log_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void ring_add(int level, const char *msg) {
+    pthread_mutex_lock(&ring_lock);
+    gps_log_entry *e = &ring[ring_next++ % GPS_LOG_RING_SIZE];
+    size_t len = strlen(msg);
+
+    // Long messages are cut
+    if (len >= sizeof(e->msg))
+        len = sizeof(e->msg) - 1;
+    e->time_ms = log_now_ms();
+    e->level = level;
+    memcpy(e->msg, msg, len);
+    e->msg[len] = '\0';
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static void ring_dump() {
+    static gps_log_entry copy[GPS_LOG_RING_SIZE];
+    unsigned next, count;
+
+    // Copied first, so that logging goes on while it is written out
+    pthread_mutex_lock(&ring_lock);
+    memcpy(copy, ring, sizeof(copy));
+    next = ring_next;
+    pthread_mutex_unlock(&ring_lock);
+
+    count = (next < GPS_LOG_RING_SIZE) ? next : GPS_LOG_RING_SIZE;
+    SLOGI("GPS:: Last %u log messages:", count);
+    for (unsigned i = next - count; i != next; i++) {
+        const gps_log_entry *e = &copy[i % GPS_LOG_RING_SIZE];
+        SLOGI("GPS:: [%lld.%03lld] %c %s", e->time_ms / 1000, e->time_ms % 1000,
+                " ?VDIWEF"[e->level & 7], e->msg);
+    }
+}
+
+static void *dump_thread(void *arg) {
+    sigset_t *set = (sigset_t *)arg;
+    int sig;
+
+    for (;;) {
+        if (sigwait(set, &sig) == 0 && sig == SIGUSR1)
+            ring_dump();
+    }
+    return NULL;
+}
+
+void gps_log_init() {
+    static sigset_t set;
+    char value[PROPERTY_VALUE_MAX];
+    pthread_t thread;
+
+    property_get(GPS_LOG_RING_PROPERTY, value, "0");
+    if (strcmp(value, "1") != 0)
+        return;
+
+    // Only the dump thread takes SIGUSR1, the others inherit the mask
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (pthread_create(&thread, NULL, dump_thread, &set) != 0) {
+        SLOGE("GPS:: Unable to start the log dump thread");
+        pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        return;
+    }
+    gps_log_ring_enabled = 1;
+}
+
+void gps_log_write(int level, int to_logcat, const char *fmt, ...) {
+    char msg[256];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    if (to_logcat)
+        __android_log_buf_write(LOG_ID_SYSTEM, level, LOG_TAG, msg);
+    if (gps_log_ring_enabled)
+        ring_add(level, msg);
+}
+
+int gps_log_allow(gps_log_site *site, int level, int interval_ms) {
+    long long now = log_now_ms();
+
+    if (now < site->next_ms) {
+        site->suppressed++;
+        return 0;
+    }
+
+    if (site->suppressed > 0)
+        GPS_LOG(level, "GPS:: %u similar messages suppressed", site->suppressed);
+    site->next_ms = now + interval_ms;
+    site->suppressed = 0;
+    return 1;
+}
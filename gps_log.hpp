@@ -0,0 +1,60 @@
+#ifndef GPS_LOG_H_
+#define GPS_LOG_H_
+
+#include <cutils/log.h>
+
+/* Logging of the hot paths of local_gps:
+ *  - GPS_LOG() calls below GPS_LOG_RING_LEVEL are compiled out with their
+ *    arguments, the ones below GPS_LOG_LEVEL only go to the ring
+ *  - GPS_LOG_LIMIT() lets a call site through at most once per interval,
+ *    how many messages were suppressed is logged with the next one
+ *  - with GPS_LOG_RING_PROPERTY set to "1", the last GPS_LOG_RING_SIZE
+ *    messages are kept in memory and dumped to the log on SIGUSR1
+ * Levels are the android_LogPriority ones.
+ */
+#ifndef GPS_LOG_LEVEL
+# if GPS_DEBUG
+#  define GPS_LOG_LEVEL  ANDROID_LOG_DEBUG
+# else
+#  define GPS_LOG_LEVEL  ANDROID_LOG_INFO
+# endif
+#endif
+
+#ifndef GPS_LOG_RING_LEVEL
+# define GPS_LOG_RING_LEVEL  ANDROID_LOG_DEBUG
+#endif
+
+#define GPS_LOG_RING_PROPERTY  "aic.gps.log_ring"
+#define GPS_LOG_RING_SIZE      256
+#define GPS_LOG_RING_MSG_SIZE  120
+
+typedef struct {
+    long long next_ms;
+    unsigned suppressed;
+} gps_log_site;
+
+extern int gps_log_ring_enabled;
+
+#define GPS_LOG(level, ...) do { \
+        if ((level) >= GPS_LOG_LEVEL) \
+            gps_log_write(level, 1, __VA_ARGS__); \
+        else if ((level) >= GPS_LOG_RING_LEVEL && gps_log_ring_enabled) \
+            gps_log_write(level, 0, __VA_ARGS__); \
+    } while (0)
+
+#define GPS_LOG_LIMIT(level, interval_ms, ...) do { \
+        static gps_log_site _gps_log_site; \
+        if ((level) >= GPS_LOG_RING_LEVEL && \
+            gps_log_allow(&_gps_log_site, level, interval_ms)) \
+            GPS_LOG(level, __VA_ARGS__); \
+    } while (0)
+
+/* Read the configuration. Call it before creating threads, they must
+ * inherit the blocked SIGUSR1 */
+void gps_log_init();
+
+void gps_log_write(int level, int to_logcat, const char *fmt, ...)
+        __attribute__((format(printf, 3, 4)));
+int gps_log_allow(gps_log_site *site, int level, int interval_ms);
+
+#endif
@@ -0,0 +1,475 @@
+#define LOG_TAG "gps_nmea_stats"
+
+/* Statistics of an NMEA log, for the captures of the test fleets: fix
+ * rate, gaps, checksum failures and position jumps. Sentences go through
+ * the parser of the HAL (gps_goby.cpp), so the log is read the way the
+ * framework would have received it.
+ *
+ * The log is mapped and cut into chunks of STATS_CHUNK_SIZE on line
+ * boundaries, the chunks are parsed on all cores and their statistics
+ * merged in file order. A chunk is parsed with a parser of its own, primed
+ * with the last RMC sentence before it for the date. The chunks only
+ * depend on the log, so the result does not depend on the number of
+ * threads. -c parses the whole log again with a single parser, the way
+ * the HAL reads it, and fails if the merged chunks differ from that.
+ *
+ *   gps_nmea_stats [-c] [-j threads] [-g gap_ms] [-s jump_speed] log
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gps.hpp"
+#include "gps_goby.hpp"
+
+#define STATS_CHUNK_SIZE         (1 << 20)
+#define STATS_PRIME_BYTES        4096     /* searched back for an RMC sentence */
+#define STATS_DEFAULT_GAP_MS     1500
+#define STATS_DEFAULT_JUMP_SPEED 100.     /* m/s */
+
+typedef struct {
+    int64_t time_ms;
+    int has_pos;
+    double latitude;
+    double longitude;
+} stats_epoch;
+
+typedef struct {
+    uint64_t lines;
+    uint64_t sentences;
+    uint64_t bad_checksum;
+    uint64_t too_long;
+    uint64_t garbage;           /* lines that are not a sentence */
+    uint64_t fixes;
+    uint64_t epochs;            /* fixes with distinct timestamps */
+    uint64_t positions;         /* epochs with a position */
+    uint64_t gaps;
+    uint64_t jumps;
+    uint64_t backwards;         /* epochs older than the one before */
+    int64_t max_gap_ms;
+    double max_jump_m;
+    stats_epoch first;
+    stats_epoch last;
+    stats_epoch first_pos;
+    stats_epoch last_pos;
+} nmea_stats;
+
+typedef struct {
+    int64_t gap_ms;
+    double jump_speed;
+} stats_config;
+
+typedef struct {
+    const char *begin;
+    const char *end;
+    nmea_stats stats;
+} stats_chunk;
+
+typedef struct {
+    const char *base;
+    const stats_config *config;
+    stats_chunk *chunks;
+    int count;
+    int next;                   /* next chunk to parse, shared by the workers */
+} stats_job;
+
+static double epoch_distance(const stats_epoch *a, const stats_epoch *b) {
+    double dlon = b->longitude - a->longitude;
+    double north, east;
+
+    if (dlon > 180.)
+        dlon -= 360.;
+    else if (dlon < -180.)
+        dlon += 360.;
+    north = (b->latitude - a->latitude) * GPS_METERS_PER_DEG;
+    east = dlon * GPS_METERS_PER_DEG * cos((a->latitude + b->latitude) * (M_PI / 360.));
+    return sqrt(north * north + east * east);
+}
+
+/* Checks the step from epoch a to the next one, b */
+static void stats_time_step(nmea_stats *st, const stats_config *cfg,
+                            const stats_epoch *a, const stats_epoch *b) {
+    int64_t dt = b->time_ms - a->time_ms;
+
+    if (dt < 0) {
+        st->backwards++;
+    } else if (dt > cfg->gap_ms) {
+        st->gaps++;
+        if (dt > st->max_gap_ms)
+            st->max_gap_ms = dt;
+    }
+}
+
+/* Checks the move from position a to the next one, b */
+static void stats_pos_step(nmea_stats *st, const stats_config *cfg,
+                           const stats_epoch *a, const stats_epoch *b) {
+    int64_t dt = b->time_ms - a->time_ms;
+    double d;
+
+    if (dt <= 0)
+        return;
+    d = epoch_distance(a, b);
+    if (d * 1000 > cfg->jump_speed * dt) {
+        st->jumps++;
+        if (d > st->max_jump_m)
+            st->max_jump_m = d;
+    }
+}
+
+static void stats_fix(nmea_stats *st, const stats_config *cfg, const GpsLocation *fix) {
+    stats_epoch e;
+
+    st->fixes++;
+    e.time_ms = fix->timestamp;
+    e.has_pos = (fix->flags & GPS_LOCATION_HAS_LAT_LONG) != 0;
+    e.latitude = fix->latitude;
+    e.longitude = fix->longitude;
+
+    // An epoch is reported once per sentence, positions are checked when
+    // an epoch first has one
+    if (st->epochs == 0 || e.time_ms != st->last.time_ms) {
+        if (st->epochs == 0)
+            st->first = e;
+        else
+            stats_time_step(st, cfg, &st->last, &e);
+        st->last = e;
+        st->epochs++;
+    }
+    if (e.has_pos && (st->positions == 0 || e.time_ms != st->last_pos.time_ms)) {
+        if (st->positions == 0)
+            st->first_pos = e;
+        else
+            stats_pos_step(st, cfg, &st->last_pos, &e);
+        st->last_pos = e;
+        st->positions++;
+    }
+}
+
+/* Appends the statistics of the chunk that follows. An epoch cut in two
+ * by the chunk boundary is only counted once */
+static void stats_merge(nmea_stats *st, const stats_config *cfg, const nmea_stats *next) {
+    uint64_t epochs = st->epochs;
+    uint64_t positions = st->positions;
+
+    st->lines += next->lines;
+    st->sentences += next->sentences;
+    st->bad_checksum += next->bad_checksum;
+    st->too_long += next->too_long;
+    st->garbage += next->garbage;
+    st->fixes += next->fixes;
+    st->epochs += next->epochs;
+    st->positions += next->positions;
+    st->gaps += next->gaps;
+    st->jumps += next->jumps;
+    st->backwards += next->backwards;
+    if (next->max_gap_ms > st->max_gap_ms)
+        st->max_gap_ms = next->max_gap_ms;
+    if (next->max_jump_m > st->max_jump_m)
+        st->max_jump_m = next->max_jump_m;
+
+    if (next->epochs > 0) {
+        if (epochs == 0)
+            st->first = next->first;
+        else if (next->first.time_ms == st->last.time_ms)
+            st->epochs--;
+        else
+            stats_time_step(st, cfg, &st->last, &next->first);
+        st->last = next->last;
+    }
+    if (next->positions > 0) {
+        if (positions == 0)
+            st->first_pos = next->first_pos;
+        else if (next->first_pos.time_ms == st->last_pos.time_ms)
+            st->positions--;
+        else
+            stats_pos_step(st, cfg, &st->last_pos, &next->first_pos);
+        st->last_pos = next->last_pos;
+    }
+}
+
+static const char *line_end(const char *p, const char *end) {
+    const char *q = (const char *)memchr(p, '\n', end - p);
+    return (q == NULL) ? end : q + 1;
+}
+
+/* Feeds the parser the last RMC sentence before the chunk, if it is near */
+static void stats_prime(NmeaParser *parser, const char *base, const char *begin) {
+    const char *limit = (begin - base > STATS_PRIME_BYTES) ? begin - STATS_PRIME_BYTES : base;
+    const char *q = begin;
+    GpsLocation fix;
+
+    while (q > limit) {
+        const char *p = q - 1;
+
+        while (p > limit && p[-1] != '\n')
+            p--;
+        if (q - p > 6 && p[0] == '$' && !memcmp(p + 3, "RMC", 3)) {
+            nmea_parser_sentence(parser, p, q, &fix);
+            return;
+        }
+        q = p;
+    }
+}
+
+static void stats_parse(stats_chunk *chunk, const char *base, const stats_config *cfg) {
+    nmea_stats *st = &chunk->stats;
+    NmeaParser *parser = nmea_parser_new();
+    const char *p, *q;
+    GpsLocation fix;
+
+    if (parser == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    stats_prime(parser, base, chunk->begin);
+
+    for (p = chunk->begin; p < chunk->end; p = q) {
+        q = line_end(p, chunk->end);
+        st->lines++;
+
+        if (p[0] != '$') {
+            if (p[0] != '\n' && p[0] != '\r')
+                st->garbage++;
+            continue;
+        }
+        st->sentences++;
+        if (q - p > NMEA_MAX_SIZE) {
+            st->too_long++;
+            continue;
+        }
+
+        switch (nmea_parser_sentence(parser, p, q, &fix)) {
+        case -1:
+            st->bad_checksum++;
+            break;
+        case 1:
+            stats_fix(st, cfg, &fix);
+            break;
+        }
+    }
+    nmea_parser_free(parser);
+}
+
+static void *stats_worker(void *arg) {
+    stats_job *job = (stats_job *)arg;
+    int n;
+
+    while ((n = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+        stats_parse(&job->chunks[n], job->base, job->config);
+    return NULL;
+}
+
+/* Cuts [base, base+size) into chunks of about STATS_CHUNK_SIZE that end
+ * on line boundaries, there is room for size / STATS_CHUNK_SIZE + 1 */
+static int stats_split(const char *base, size_t size, stats_chunk *chunks) {
+    const char *end = base + size;
+    const char *p = base;
+    int n = 0;
+
+    while (p < end) {
+        const char *q = base + (size_t)STATS_CHUNK_SIZE * (n + 1);
+
+        if (q < p)
+            q = p;
+        q = (q < end) ? line_end(q, end) : end;
+        memset(&chunks[n], 0, sizeof(chunks[n]));
+        chunks[n].begin = p;
+        chunks[n].end = q;
+        p = q;
+        n++;
+    }
+    return n;
+}
+
+/* Parses the chunks of job on threads and merges them into total */
+static int stats_run(stats_job *job, int threads, nmea_stats *total) {
+    pthread_t *workers = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    int n;
+
+    if (workers == NULL)
+        return -1;
+
+    job->next = 0;
+    for (n = 0; n < job->count; n++)
+        memset(&job->chunks[n].stats, 0, sizeof(nmea_stats));
+
+    // the main thread is the last worker
+    for (n = 0; n < threads - 1; n++) {
+        if (pthread_create(&workers[n], NULL, stats_worker, job) != 0) {
+            free(workers);
+            return -1;
+        }
+    }
+    stats_worker(job);
+    for (n = 0; n < threads - 1; n++)
+        pthread_join(workers[n], NULL);
+    free(workers);
+
+    memset(total, 0, sizeof(*total));
+    for (n = 0; n < job->count; n++)
+        stats_merge(total, job->config, &job->chunks[n].stats);
+    return 0;
+}
+
+static int epoch_equal(const stats_epoch *a, const stats_epoch *b) {
+    return a->time_ms == b->time_ms && a->has_pos == b->has_pos &&
+           a->latitude == b->latitude && a->longitude == b->longitude;
+}
+
+static int stats_equal(const nmea_stats *a, const nmea_stats *b) {
+    return a->lines == b->lines && a->sentences == b->sentences &&
+           a->bad_checksum == b->bad_checksum && a->too_long == b->too_long &&
+           a->garbage == b->garbage && a->fixes == b->fixes &&
+           a->epochs == b->epochs && a->positions == b->positions &&
+           a->gaps == b->gaps && a->jumps == b->jumps &&
+           a->backwards == b->backwards && a->max_gap_ms == b->max_gap_ms &&
+           a->max_jump_m == b->max_jump_m &&
+           epoch_equal(&a->first, &b->first) && epoch_equal(&a->last, &b->last) &&
+           epoch_equal(&a->first_pos, &b->first_pos) &&
+           epoch_equal(&a->last_pos, &b->last_pos);
+}
+
+static double elapsed_s(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void stats_print(const nmea_stats *st, size_t size, double seconds, int threads) {
+    double span = (st->epochs > 1) ? (st->last.time_ms - st->first.time_ms) / 1000. : 0;
+
+    printf("lines          %llu\n", (unsigned long long)st->lines);
+    printf("sentences      %llu\n", (unsigned long long)st->sentences);
+    printf("bad checksum   %llu\n", (unsigned long long)st->bad_checksum);
+    printf("too long       %llu\n", (unsigned long long)st->too_long);
+    printf("not NMEA       %llu\n", (unsigned long long)st->garbage);
+    printf("fixes          %llu\n", (unsigned long long)st->fixes);
+    printf("epochs         %llu", (unsigned long long)st->epochs);
+    if (span > 0)
+        printf(" over %.0fs, %.3f Hz", span, (st->epochs - 1) / span);
+    printf("\n");
+    printf("positions      %llu\n", (unsigned long long)st->positions);
+    printf("gaps           %llu", (unsigned long long)st->gaps);
+    if (st->gaps > 0)
+        printf(", longest %.3fs", st->max_gap_ms / 1000.);
+    printf("\n");
+    printf("jumps          %llu", (unsigned long long)st->jumps);
+    if (st->jumps > 0)
+        printf(", largest %.0fm", st->max_jump_m);
+    printf("\n");
+    printf("time backwards %llu\n", (unsigned long long)st->backwards);
+    fprintf(stderr, "%.1f MB in %.3fs on %d threads, %.0f MB/s\n",
+            size / 1e6, seconds, threads, (seconds > 0) ? size / 1e6 / seconds : 0.);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-c] [-j threads] [-g gap_ms] [-s jump_speed_m/s] log\n", name);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    stats_config cfg = { STATS_DEFAULT_GAP_MS, STATS_DEFAULT_JUMP_SPEED };
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    stats_chunk *chunks = NULL;
+    stats_job job;
+    nmea_stats total;
+    struct timespec start;
+    struct stat st;
+    const char *base = NULL;
+    double seconds = 0.;
+    int check = 0, status = 0;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "cj:g:s:")) != -1) {
+        switch (opt) {
+        case 'c':
+            check = 1;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'g':
+            cfg.gap_ms = atoll(optarg);
+            break;
+        case 's':
+            cfg.jump_speed = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || threads < 1 || cfg.gap_ms <= 0 || cfg.jump_speed <= 0)
+        usage(argv[0]);
+
+    fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(&total, 0, sizeof(total));
+    memset(&job, 0, sizeof(job));
+
+    if (st.st_size > 0) {
+        size_t size = st.st_size;
+        size_t count = size / STATS_CHUNK_SIZE + 1;
+
+        base = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            fprintf(stderr, "%s: mmap failed: %s\n", argv[optind], strerror(errno));
+            return 1;
+        }
+        madvise((void *)base, size, MADV_SEQUENTIAL);
+
+        chunks = (stats_chunk *)calloc(count, sizeof(stats_chunk));
+        if (chunks == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        job.base = base;
+        job.config = &cfg;
+        job.chunks = chunks;
+        job.count = stats_split(base, size, chunks);
+        if (threads > job.count)
+            threads = job.count;
+
+        if (stats_run(&job, threads, &total) < 0) {
+            fprintf(stderr, "Unable to start worker threads\n");
+            return 1;
+        }
+        seconds = elapsed_s(&start);
+
+        if (check) {
+            stats_chunk whole;
+
+            memset(&whole, 0, sizeof(whole));
+            whole.begin = base;
+            whole.end = base + size;
+            stats_parse(&whole, base, &cfg);
+            if (!stats_equal(&total, &whole.stats)) {
+                fprintf(stderr, "%s: results of the %d chunks and of one pass differ\n",
+                        argv[optind], job.count);
+                status = 1;
+            }
+        }
+
+        free(chunks);
+        munmap((void *)base, size);
+    }
+    close(fd);
+
+    stats_print(&total, st.st_size, seconds, threads);
+    return status;
+}
@@ -0,0 +1,155 @@
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "gps.hpp"
+#include "gps_noise.hpp"
+
+#define ZIGGURAT_LAYERS 128
+#define ZIGGURAT_R      3.442619855899          /* start of the tail */
+#define ZIGGURAT_V      9.91256303526217e-3     /* area of a layer */
+
+/* 68% of a 2D gaussian falls within 1.515 sigma */
+#define SIGMA_PER_ACCURACY  (1. / 1.515)
+#define VERTICAL_FACTOR     1.5
+
+static double zig_x[ZIGGURAT_LAYERS + 1];
+static double zig_ratio[ZIGGURAT_LAYERS];
+static pthread_once_t zig_once = PTHREAD_ONCE_INIT;
+
+static void ziggurat_setup() {
+    double f = exp(-0.5 * ZIGGURAT_R * ZIGGURAT_R);
+
+    zig_x[0] = ZIGGURAT_V / f;
+    zig_x[1] = ZIGGURAT_R;
+    zig_x[ZIGGURAT_LAYERS] = 0.;
+    for (int i = 2; i < ZIGGURAT_LAYERS; i++) {
+        zig_x[i] = sqrt(-2. * log(ZIGGURAT_V / zig_x[i - 1] + f));
+        f = exp(-0.5 * zig_x[i] * zig_x[i]);
+    }
+    for (int i = 0; i < ZIGGURAT_LAYERS; i++)
+        zig_ratio[i] = zig_x[i + 1] / zig_x[i];
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+uint64_t xoshiro256_next(xoshiro256 *rng) {
+    uint64_t *s = rng->s;
+    uint64_t result = s[0] + s[3];
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+/* Uniform in (0, 1) from the top 53 bits */
+static inline double uniform(xoshiro256 *rng) {
+    return ((xoshiro256_next(rng) >> 11) + 0.5) * (1. / 9007199254740992.);
+}
+
+double noise_gaussian(xoshiro256 *rng) {
+    for (;;) {
+        uint64_t bits = xoshiro256_next(rng);
+        int i = bits & (ZIGGURAT_LAYERS - 1);
+        double u = 2. * ((bits >> 11) * (1. / 9007199254740992.)) - 1.;
+        double x, f0, f1;
+
+        // Inside the rectangle of the layer, nearly always
+        if (fabs(u) < zig_ratio[i])
+            return u * zig_x[i];
+
+        if (i == 0) {
+            double y;
+            do {
+                x = log(uniform(rng)) / ZIGGURAT_R;
+                y = log(uniform(rng));
+            } while (-2. * y < x * x);
+            return (u < 0.) ? x - ZIGGURAT_R : ZIGGURAT_R - x;
+        }
+
+        x = u * zig_x[i];
+        f0 = exp(-0.5 * (zig_x[i] * zig_x[i] - x * x));
+        f1 = exp(-0.5 * (zig_x[i + 1] * zig_x[i + 1] - x * x));
+        if (f1 + uniform(rng) * (f0 - f1) < 1.)
+            return x;
+    }
+}
+
+void noise_init(gps_noise *noise, uint64_t seed) {
+    pthread_once(&zig_once, ziggurat_setup);
+
+    // splitmix64 to spread the seed over the whole state
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        noise->rng.s[i] = z ^ (z >> 31);
+    }
+
+    noise->walk_north = noise->walk_east = noise->walk_up = 0.;
+    noise->start_ms = noise->last_ms = -1;
+}
+
+int noise_apply(gps_noise *noise, gps_fix *fix, double accuracy, long long now_ms) {
+    double sigma = accuracy * SIGMA_PER_ACCURACY;
+    double north, east, up, coslat;
+
+    if (!noise->enabled)
+        return 0;
+
+    if (noise->start_ms < 0)
+        noise->start_ms = noise->last_ms = now_ms;
+
+    if (noise->outage_period > 0 &&
+        (now_ms - noise->start_ms) / 1000 % noise->outage_period < noise->outage_duration)
+        return -1;
+
+    if (noise->walk_sigma > 0. && noise->walk_tau > 0.) {
+        double decay = exp(-(now_ms - noise->last_ms) / (1000. * noise->walk_tau));
+        double step = noise->walk_sigma * sqrt(1. - decay * decay);
+
+        noise->walk_north = noise->walk_north * decay + step * noise_gaussian(&noise->rng);
+        noise->walk_east = noise->walk_east * decay + step * noise_gaussian(&noise->rng);
+        noise->walk_up = noise->walk_up * decay + step * noise_gaussian(&noise->rng);
+    }
+    noise->last_ms = now_ms;
+
+    north = noise->walk_north + sigma * noise_gaussian(&noise->rng);
+    east = noise->walk_east + sigma * noise_gaussian(&noise->rng);
+    up = noise->walk_up + VERTICAL_FACTOR * sigma * noise_gaussian(&noise->rng);
+
+    if (noise->multipath_prob > 0. && uniform(&noise->rng) < noise->multipath_prob) {
+        double angle = 2. * M_PI * uniform(&noise->rng);
+        double jump = noise->multipath_m * (0.5 + uniform(&noise->rng));
+
+        north += jump * cos(angle);
+        east += jump * sin(angle);
+    }
+
+    coslat = cos(fix->latitude * (M_PI / 180. / GPS_COORD_SCALE));
+    if (coslat < 0.01)
+        coslat = 0.01;
+
+    fix->latitude += llround(north / GPS_METERS_PER_DEG * GPS_COORD_SCALE);
+    fix->longitude += llround(east / (GPS_METERS_PER_DEG * coslat) * GPS_COORD_SCALE);
+    fix->altitude += up;
+
+    // Stay on the globe
+    if (fix->latitude > 90 * GPS_COORD_SCALE)
+        fix->latitude = 90 * GPS_COORD_SCALE;
+    else if (fix->latitude < -90 * GPS_COORD_SCALE)
+        fix->latitude = -90 * GPS_COORD_SCALE;
+    if (fix->longitude > 180 * GPS_COORD_SCALE)
+        fix->longitude -= 360 * GPS_COORD_SCALE;
+    else if (fix->longitude < -180 * GPS_COORD_SCALE)
+        fix->longitude += 360 * GPS_COORD_SCALE;
+    return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef GPS_NOISE_H_
+#define GPS_NOISE_H_
+
+#include <stdint.h>
+
+#include "local_gps.hpp"
+
+/* Degradation of the simulated fixes:
+ *  - gaussian horizontal and vertical error, its spread follows the
+ *    reported accuracy (68% of the fixes within the accuracy radius)
+ *  - a slowly wandering bias (Gauss-Markov random walk), walk_sigma
+ *    metres of spread with a walk_tau seconds correlation time
+ *  - multipath jumps: with multipath_prob per fix, an extra error of
+ *    about multipath_m metres in a random direction
+ *  - outages: no fix for outage_duration seconds every outage_period
+ * Random numbers come from xoshiro256+ and a ziggurat gaussian sampler,
+ * so a fix costs a few nanoseconds and a seed replays the same noise.
+ */
+typedef struct {
+    uint64_t s[4];
+} xoshiro256;
+
+typedef struct {
+    int enabled;
+    xoshiro256 rng;
+    double walk_sigma;
+    double walk_tau;
+    double multipath_prob;
+    double multipath_m;
+    int outage_period;
+    int outage_duration;
+    /* state */
+    double walk_north;
+    double walk_east;
+    double walk_up;
+    long long start_ms;
+    long long last_ms;
+} gps_noise;
+
+void noise_init(gps_noise *noise, uint64_t seed);
+
+/* Degrade fix, given the accuracy reported with it in metres. Returns -1
+ * during an outage, the fix must not be emitted then. */
+int noise_apply(gps_noise *noise, gps_fix *fix, double accuracy, long long now_ms);
+
+uint64_t xoshiro256_next(xoshiro256 *rng);
+double noise_gaussian(xoshiro256 *rng);
+
+#endif
@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "gps_property.hpp"
+
+void cached_property_init(cached_property *p, const char *name, const char *default_value) {
+    p->name = name;
+    p->default_value = default_value;
+    p->pi = NULL;
+    p->serial = 0;
+    p->value[0] = '\0';
+    cached_property_refresh(p);
+    if (p->pi == NULL)
+        strcpy(p->value, default_value);
+}
+
+int cached_property_refresh(cached_property *p) {
+    char value[PROPERTY_VALUE_MAX];
+    unsigned serial;
+
+    // A property that was never set keeps its default until it is
+    if (p->pi == NULL) {
+        if ((p->pi = __system_property_find(p->name)) == NULL)
+            return 0;
+        p->serial = __system_property_serial(p->pi) + 1;
+    }
+
+    serial = __system_property_serial(p->pi);
+    if (serial == p->serial)
+        return 0;
+    p->serial = serial;
+
+    // Same as property_get(): an empty value is the default
+    if (__system_property_read(p->pi, NULL, value) <= 0)
+        strcpy(value, p->default_value);
+
+    if (strcmp(value, p->value) == 0)
+        return 0;
+    strcpy(p->value, value);
+    return 1;
+}
+
+void cached_property_set(cached_property *p, const char *value) {
+    cached_property_refresh(p);
+    if (strcmp(value, p->value) == 0)
+        return;
+
+    property_set(p->name, value);
+    snprintf(p->value, sizeof(p->value), "%s", value);
+}
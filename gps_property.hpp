@@ -0,0 +1,27 @@
+#ifndef GPS_PROPERTY_H_
+#define GPS_PROPERTY_H_
+
+#include <cutils/properties.h>
+#include <sys/system_properties.h>
+
+/* Property value cached by one thread. A refresh only reads the serial
+ * number of the property in the shared property area, the value is
+ * copied when the serial changed: while nothing changes there is no
+ * property_get() and nothing to parse again. */
+typedef struct {
+    const char *name;
+    const char *default_value;
+    const prop_info *pi;        /* NULL until the property exists */
+    unsigned serial;
+    char value[PROPERTY_VALUE_MAX];
+} cached_property;
+
+void cached_property_init(cached_property *p, const char *name, const char *default_value);
+
+/* Returns 1 if the value changed since the last refresh */
+int cached_property_refresh(cached_property *p);
+
+/* property_set() value, unless the property already has it */
+void cached_property_set(cached_property *p, const char *value);
+
+#endif
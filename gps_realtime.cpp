@@ -0,0 +1,84 @@
+#define LOG_TAG "local_gps"
+#include <cutils/log.h>
+
+#include <sys/mman.h>
+#include <sys/errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gps_realtime.hpp"
+
+/* Upper bounds of the buckets, the last one catches everything else */
+static const int64_t jitter_bounds_us[JITTER_BUCKETS - 1] = {
+    10, 50, 100, 250, 500, 1000, 2000, 5000, 10000, 50000, 100000
+};
+
+int realtime_setup(int priority, int cpu) {
+    struct sched_param param;
+    int ret = 0, err;
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0) {
+        SLOGE("GPS:: Unable to use SCHED_FIFO priority %d, errno=%d", priority, err);
+        ret = -1;
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            SLOGE("GPS:: Unable to pin the emit thread to CPU %d, errno=%d", cpu, errno);
+            ret = -1;
+        }
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        SLOGE("GPS:: Unable to lock memory, errno=%d", errno);
+        ret = -1;
+    }
+
+    SLOGI("GPS:: Low-jitter emission, priority %d, CPU %d", priority, cpu);
+    return ret;
+}
+
+void jitter_record(jitter_histogram *h, int64_t late_ns) {
+    int i = 0;
+
+    // Early is as bad as late
+    if (late_ns < 0)
+        late_ns = -late_ns;
+
+    while (i < JITTER_BUCKETS - 1 && late_ns >= jitter_bounds_us[i] * 1000)
+        i++;
+
+    h->count[i]++;
+    h->total++;
+    h->sum_ns += late_ns;
+    if (late_ns > h->max_ns)
+        h->max_ns = late_ns;
+}
+
+void jitter_log(const jitter_histogram *h) {
+    char buf[256];
+    int len = 0;
+
+    if (h->total == 0)
+        return;
+
+    for (int i = 0; i < JITTER_BUCKETS && len < (int)sizeof(buf); i++) {
+        if (i == JITTER_BUCKETS - 1)
+            len += snprintf(buf + len, sizeof(buf) - len, " more:%u", h->count[i]);
+        else
+            len += snprintf(buf + len, sizeof(buf) - len, " <%lldus:%u",
+                    (long long)jitter_bounds_us[i], h->count[i]);
+    }
+
+    SLOGI("GPS:: Emission jitter over %u epochs, mean %lldus, max %lldus,%s",
+            h->total, (long long)(h->sum_ns / h->total / 1000),
+            (long long)(h->max_ns / 1000), buf);
+}
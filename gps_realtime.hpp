@@ -0,0 +1,27 @@
+#ifndef GPS_REALTIME_H_
+#define GPS_REALTIME_H_
+
+#include <stdint.h>
+
+/* Low-jitter emission: the calling (emit) thread is moved to SCHED_FIFO
+ * at priority and pinned to cpu (-1 for any), and the daemon memory is
+ * locked, so that neither host load nor page faults delay an epoch.
+ * Threads created afterwards inherit the policy. Returns -1 if any step
+ * failed, the others are still applied. */
+int realtime_setup(int priority, int cpu);
+
+/* Histogram of how far from their schedule epochs go out, in buckets
+ * from 10us to 100ms plus one for anything later */
+#define JITTER_BUCKETS  12
+
+typedef struct {
+    uint32_t count[JITTER_BUCKETS];
+    uint32_t total;
+    int64_t sum_ns;
+    int64_t max_ns;
+} jitter_histogram;
+
+void jitter_record(jitter_histogram *h, int64_t late_ns);
+void jitter_log(const jitter_histogram *h);
+
+#endif
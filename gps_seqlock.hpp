@@ -0,0 +1,63 @@
+#ifndef GPS_SEQLOCK_H_
+#define GPS_SEQLOCK_H_
+
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/* Seqlock of the shared mappings (sample ring, virtual clock): the writer
+ * makes 'seq' odd while it writes, a reader copies the data and starts
+ * over when 'seq' was odd or moved meanwhile.
+ *
+ *   for (int retry = 0; retry < GPS_SEQLOCK_READ_RETRIES; retry++) {
+ *       uint32_t seq = gps_seqlock_read_begin(&shared->seq);
+ *       ... copy ...
+ *       if (!gps_seqlock_read_retry(&shared->seq, seq))
+ *           return 0;
+ *   }
+ *
+ * The data is plain memory, only 'seq' is accessed atomically.
+ */
+
+/* Reads before giving up. A writer is done in a few hundred nanoseconds
+ * and yielding lets a preempted one finish, so this is only ever reached
+ * when it stopped in the middle of a write */
+#define GPS_SEQLOCK_READ_RETRIES  64
+
+static inline int gps_futex(uint32_t *word, int op, uint32_t value,
+                            const struct timespec *timeout) {
+    return syscall(__NR_futex, word, op, value, timeout, NULL, 0);
+}
+
+static inline void gps_seqlock_write_begin(uint32_t *seq) {
+    __atomic_store_n(seq, __atomic_load_n(seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void gps_seqlock_write_end(uint32_t *seq) {
+    __atomic_store_n(seq, __atomic_load_n(seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+/* Even seq to copy the data at. Yields while a write is in progress, and
+ * returns the odd seq if it stays in one, the copy is then retried */
+static inline uint32_t gps_seqlock_read_begin(uint32_t *seq) {
+    uint32_t value = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+
+    if (value & 1) {
+        sched_yield();
+        value = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+    }
+    return value;
+}
+
+/* Nonzero if the data copied since gps_seqlock_read_begin() returned
+ * begin is not consistent */
+static inline int gps_seqlock_read_retry(uint32_t *seq, uint32_t begin) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (begin & 1) || __atomic_load_n(seq, __ATOMIC_RELAXED) != begin;
+}
+
+#endif
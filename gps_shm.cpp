@@ -0,0 +1,139 @@
+#define LOG_TAG "local_gps"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cutils/log.h>
+
+#include "gps_seqlock.hpp"
+#include "gps_shm.hpp"
+
+static gps_shm_ring *shm_map(int fd) {
+    void *map = mmap(NULL, sizeof(gps_shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+    return (map == MAP_FAILED) ? NULL : (gps_shm_ring *)map;
+}
+
+int shm_ring_open(const char *path, gps_shm_ring **ring) {
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(gps_shm_ring)) {
+        close(fd);
+        return -1;
+    }
+    if ((*ring = shm_map(fd)) == NULL)
+        return -1;
+
+    // The producer sets the magic last
+    if (__atomic_load_n(&(*ring)->magic, __ATOMIC_ACQUIRE) != GPS_SHM_MAGIC ||
+        (*ring)->version != GPS_SHM_VERSION || (*ring)->slots != GPS_SHM_SLOTS) {
+        SLOGE("GPS:: %s is not a GPS sample ring", path);
+        shm_ring_close(*ring);
+        return -1;
+    }
+    return 0;
+}
+
+int shm_ring_create(const char *path, gps_shm_ring **ring) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, sizeof(gps_shm_ring)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if ((*ring = shm_map(fd)) == NULL)
+        return -1;
+
+    memset(*ring, 0, sizeof(gps_shm_ring));
+    (*ring)->version = GPS_SHM_VERSION;
+    (*ring)->slots = GPS_SHM_SLOTS;
+    __atomic_store_n(&(*ring)->magic, GPS_SHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void shm_ring_close(gps_shm_ring *ring) {
+    munmap(ring, sizeof(*ring));
+}
+
+void shm_ring_publish(gps_shm_ring *ring, const gps_fix *fix) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    gps_shm_sample *s = &ring->sample[head % GPS_SHM_SLOTS];
+
+    gps_seqlock_write_begin(&s->seq);
+    s->enabled = fix->enabled;
+    s->latitude = fix->latitude;
+    s->longitude = fix->longitude;
+    s->altitude = fix->altitude;
+    s->bearing = fix->bearing;
+    s->time_ms = fix->time_ms;
+    gps_seqlock_write_end(&s->seq);
+
+    // Sequentially consistent with the 'waiting' of shm_ring_wait(), one
+    // of the two sees the other's store
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST))
+        gps_futex(&ring->head, FUTEX_WAKE, 1, NULL);
+}
+
+int shm_ring_wait(gps_shm_ring *ring, uint32_t *seen, int timeout_ms) {
+    struct timespec ts;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (head == *seen) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+        if (head == *seen)
+            gps_futex(&ring->head, FUTEX_WAIT, head, &ts);
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+
+    if (head == *seen)
+        return 0;
+    *seen = head;
+    return 1;
+}
+
+int shm_ring_latest(gps_shm_ring *ring, gps_fix *fix) {
+    for (int retry = 0; retry < GPS_SEQLOCK_READ_RETRIES; retry++) {
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        gps_shm_sample *s = &ring->sample[(head - 1) % GPS_SHM_SLOTS];
+        uint32_t seq;
+
+        if (head == 0)
+            return -1;
+
+        seq = gps_seqlock_read_begin(&s->seq);
+        fix->enabled = s->enabled;
+        fix->latitude = s->latitude;
+        fix->longitude = s->longitude;
+        fix->altitude = s->altitude;
+        fix->bearing = s->bearing;
+        fix->time_ms = s->time_ms;
+
+        // Rewritten meanwhile: the producer went round the ring, start over
+        if (!gps_seqlock_read_retry(&s->seq, seq)) {
+            fix->received_ms = 0;
+            fix->seq = 0;
+            return 0;
+        }
+    }
+
+    // The producer died while writing it, wait for the next one
+    SLOGW("GPS:: Newest sample of the ring stays inconsistent");
+    return -1;
+}
@@ -0,0 +1,61 @@
+#ifndef GPS_SHM_H_
+#define GPS_SHM_H_
+
+#include <stdint.h>
+
+#include "local_gps.hpp"
+
+/* Ring of GPS samples in a shared file mapping, for a producer on the same
+ * machine as local_gps (the sensor stack of the host). Samples are already
+ * in the units of gps_fix, there is nothing to decode.
+ *  - the producer writes the slot 'head' modulo GPS_SHM_SLOTS under its
+ *    seqlock (seq odd while written), then increments 'head'
+ *  - local_gps only takes the newest sample: when the producer goes round
+ *    the ring faster than it reads, older samples are just skipped
+ *  - 'head' is also a futex word. local_gps sets 'waiting' before it
+ *    blocks on it, the producer only wakes it up then, so that publishing
+ *    costs no system call while local_gps is busy
+ * The producer creates the file, local_gps waits for it to appear.
+ */
+#define GPS_SHM_MAGIC    0x52535047     /* "GPSR" */
+#define GPS_SHM_VERSION  1
+#define GPS_SHM_SLOTS    16
+
+typedef struct {
+    uint32_t seq;
+    uint32_t enabled;
+    int64_t latitude;           /* GPS_COORD_SCALE units per degree */
+    int64_t longitude;
+    double altitude;
+    double bearing;
+    int64_t time_ms;            /* UTC, 0 if unknown */
+} gps_shm_sample;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t waiting;
+    uint32_t head;
+    uint32_t reserved[11];      /* header on its own cache line */
+    gps_shm_sample sample[GPS_SHM_SLOTS];
+} gps_shm_ring;
+
+/* Map the ring of path, -1 if it does not exist or is not a valid one */
+int shm_ring_open(const char *path, gps_shm_ring **ring);
+
+/* Producer side: create (or reset) the ring of path */
+int shm_ring_create(const char *path, gps_shm_ring **ring);
+void shm_ring_publish(gps_shm_ring *ring, const gps_fix *fix);
+
+void shm_ring_close(gps_shm_ring *ring);
+
+/* Wait up to timeout_ms for samples past *seen, which is updated.
+ * Returns 1 if there are some */
+int shm_ring_wait(gps_shm_ring *ring, uint32_t *seen, int timeout_ms);
+
+/* Newest sample, returns -1 if none was published yet or if it could not
+ * be read consistently, the caller should then wait for the next one */
+int shm_ring_latest(gps_shm_ring *ring, gps_fix *fix);
+
+#endif
@@ -0,0 +1,113 @@
+#define LOG_TAG "gps_shm_feed"
+
+/* Stand-in for the local producer of the sample ring (see gps_shm.hpp),
+ * to run local_gps with aic.gps.shm set and no sensor stack. Creates the
+ * ring and publishes a device moving at a constant speed and bearing from
+ * the start position, at a fixed rate.
+ *
+ *   gps_shm_feed [-r rate_hz] [-n count] [-v speed_m/s] [-b bearing]
+ *                [-a altitude] ring latitude longitude
+ *
+ * With no count, it publishes until killed.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gps.hpp"
+#include "gps_shm.hpp"
+
+#define FEED_DEFAULT_RATE_HZ  1.
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-r rate_hz] [-n count] [-v speed_m/s] [-b bearing] "
+            "[-a altitude] ring latitude longitude\n", name);
+    exit(1);
+}
+
+static void timespec_add_ns(struct timespec *ts, int64_t ns) {
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+int main(int argc, char *argv[]) {
+    double rate = FEED_DEFAULT_RATE_HZ, speed = 0., bearing = 0., altitude = 0.;
+    double latitude, longitude;
+    long long count = -1;
+    gps_shm_ring *ring;
+    struct timespec next;
+    int64_t period_ns;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:n:v:b:a:")) != -1) {
+        switch (opt) {
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'n':
+            count = atoll(optarg);
+            break;
+        case 'v':
+            speed = atof(optarg);
+            break;
+        case 'b':
+            bearing = atof(optarg);
+            break;
+        case 'a':
+            altitude = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind + 3 != argc || rate <= 0.)
+        usage(argv[0]);
+    latitude = atof(argv[optind + 1]);
+    longitude = atof(argv[optind + 2]);
+
+    if (shm_ring_create(argv[optind], &ring) < 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    period_ns = (int64_t)(1e9 / rate);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (long long i = 0; count < 0 || i < count; i++) {
+        double step = speed / rate;
+        struct timespec now;
+        gps_fix fix;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        memset(&fix, 0, sizeof(fix));
+        fix.enabled = 1;
+        fix.latitude = llround(latitude * GPS_COORD_SCALE);
+        fix.longitude = llround(longitude * GPS_COORD_SCALE);
+        fix.altitude = altitude;
+        fix.bearing = bearing;
+        fix.time_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        shm_ring_publish(ring, &fix);
+
+        // On the local plane, good enough between two samples
+        latitude += step * cos(bearing * M_PI / 180.) / GPS_METERS_PER_DEG;
+        longitude += step * sin(bearing * M_PI / 180.) /
+                     (GPS_METERS_PER_DEG * cos(latitude * M_PI / 180.));
+        if (longitude >= 180.)
+            longitude -= 360.;
+        else if (longitude < -180.)
+            longitude += 360.;
+
+        timespec_add_ns(&next, period_ns);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+    }
+
+    shm_ring_close(ring);
+    return 0;
+}
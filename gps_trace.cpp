@@ -0,0 +1,72 @@
+#define LOG_TAG "gps_trace"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+
+#include "gps.hpp"
+#include "gps_trace.hpp"
+
+static const char *trace_markers[] = {
+    "/sys/kernel/tracing/trace_marker",
+    "/sys/kernel/debug/tracing/trace_marker",
+};
+
+int gps_trace_enabled = 0;
+static int trace_fd = -1;
+static int trace_pid;
+
+/* Called by the one thread that refreshes the properties. The events of
+ * the other threads may see the change a little later, but never see
+ * trace_fd before trace_pid is set */
+void gps_trace_setup(int enable) {
+    if (enable && trace_fd == -1) {
+        int fd = -1;
+
+        for (unsigned i = 0; i < sizeof(trace_markers) / sizeof(trace_markers[0]); i++) {
+            fd = open(trace_markers[i], O_WRONLY | O_CLOEXEC);
+            if (fd != -1)
+                break;
+        }
+        if (fd == -1) {
+            ALOGE("Unable to open trace_marker, errno=%d, tracing off", errno);
+            return;
+        }
+        trace_pid = getpid();
+        __atomic_store_n(&trace_fd, fd, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&gps_trace_enabled, enable && trace_fd != -1, __ATOMIC_RELAXED);
+}
+
+void gps_trace_begin(const char *stage, unsigned seq) {
+    int fd = __atomic_load_n(&trace_fd, __ATOMIC_ACQUIRE);
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "B|%d|%s #%u", trace_pid, stage, seq);
+
+    if (len > (int)sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    write(fd, buf, len);
+}
+
+void gps_trace_end(void) {
+    int fd = __atomic_load_n(&trace_fd, __ATOMIC_ACQUIRE);
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "E|%d", trace_pid);
+
+    write(fd, buf, len);
+}
+
+unsigned gps_trace_message_seq(const char *msg, int len) {
+    int prefix = sizeof(GPS_TRACE_SENTENCE) - 1;
+    unsigned seq = 0;
+
+    if (len <= prefix || memcmp(msg, GPS_TRACE_SENTENCE, prefix) != 0 || msg[prefix] != ',')
+        return 0;
+    for (int i = prefix + 1; i < len && (unsigned)(msg[i] - '0') <= 9; i++)
+        seq = seq * 10 + (msg[i] - '0');
+    return seq;
+}
@@ -0,0 +1,40 @@
+#ifndef GPS_TRACE_H_
+#define GPS_TRACE_H_
+
+/* Trace events of the fix pipeline, written to the ftrace trace_marker in
+ * the atrace format, so that systrace and perfetto show them as slices
+ * on the system-wide timeline. Each slice is named after a stage and the
+ * sequence number of the fix, "<stage> #<seq>", so that one fix can be
+ * followed from local_gps into the HAL. local_gps sends the sequence
+ * number in a GPS_TRACE_SENTENCE ahead of the epoch while tracing is on.
+ *
+ * Both binaries build this file. While tracing is off, an event costs the
+ * test of gps_trace_enabled. The thread that refreshes the properties sets
+ * it while the others test it, so it is only read through GPS_TRACE_ON().
+ */
+extern int gps_trace_enabled;
+
+#define GPS_TRACE_ON() __builtin_expect(__atomic_load_n(&gps_trace_enabled, __ATOMIC_RELAXED), 0)
+
+#define GPS_TRACE_BEGIN(stage, seq) do { \
+        if (GPS_TRACE_ON()) \
+            gps_trace_begin(stage, seq); \
+    } while (0)
+
+#define GPS_TRACE_END() do { \
+        if (GPS_TRACE_ON()) \
+            gps_trace_end(); \
+    } while (0)
+
+/* Open the trace_marker the first time tracing is enabled. Stays off if
+ * it can't be opened */
+void gps_trace_setup(int enable);
+
+void gps_trace_begin(const char *stage, unsigned seq);
+void gps_trace_end(void);
+
+/* Sequence number of a message starting with a GPS_TRACE_SENTENCE, 0 if
+ * it has none */
+unsigned gps_trace_message_seq(const char *msg, int len);
+
+#endif
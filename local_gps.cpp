@@ -4,72 +4,149 @@
 
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include <stdio.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <math.h>
 #include <pthread.h>
 
 #include "aic.h"
 
 #include "gps.hpp"
+#include "local_gps.hpp"
+#include "gps_capture.hpp"
+#include "gps_noise.hpp"
+#include "gps_realtime.hpp"
+#include "gps_log.hpp"
+#include "gps_property.hpp"
+#include "gps_trace.hpp"
+#include "gps_shm.hpp"
+#include "gps_clock.hpp"
 #include "sensors_packet.pb.h"
 #include <sys/types.h>
 
 #define GPS_UPDATE_PERIOD 1 /* period in sec between 2 gps fix emission */
+#define GPS_MAX_CLIENTS   4 /* HAL plus a few debugging clients on TCP */
+#define GPS_UDP_BATCH     32 /* datagrams read by one recvmmsg() */
+#define GPS_MAX_DATAGRAM  512
 
-#define STRING_GPGGA "$GPGGA,%02d%02d%02d,%02d%02d.%04d,%c,%02d%02d.%04d,%c,1,08,%i,%f,M,0.,M,,,*47\n"
-#define STRING_GPRMC "$GPRMC,%02d%02d%02d,A,%02d%02d.%04d,%c,%02d%02d.%04d,%c,%f,%f,%02d%02d%02d,%f,*47\n"
+#define STRING_GPGGA "$GPGGA,%02d%02d%02d.%03d,%02d%02d.%0*d,%c,%03d%02d.%0*d,%c,1,08,%i,%.1f,M,0.,M,,,"
+#define STRING_GPRMC "$GPRMC,%02d%02d%02d.%03d,A,%02d%02d.%0*d,%c,%03d%02d.%0*d,%c,%.1f,%.1f,%02d%02d%02d,%.1f,"
 
 
 // Protobuff
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/wire_format_lite.h>
 
 
 using namespace google::protobuf::io;
 
-google::protobuf::uint32 readHdr(char *buf)
+/* Seqlock protecting the latest fix, written by the ingest thread only.
+ * seq is odd while a write is in progress, readers retry until they get
+ * the same even value before and after copying the fix. */
+typedef struct {
+    unsigned seq;
+    gps_fix fix;
+} gps_fix_slot;
+
+static gps_fix_slot latest_fix;
+
+static void fix_slot_store(gps_fix_slot *slot, const gps_fix *fix) {
+    unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&slot->fix, fix, sizeof(*fix));
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Returns the sequence number of the fix read, 0 if none was stored yet */
+static unsigned fix_slot_load(gps_fix_slot *slot, gps_fix *fix) {
+    unsigned seq1, seq2;
+
+    do {
+        seq1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        memcpy(fix, &slot->fix, sizeof(*fix));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    } while ((seq1 & 1) || seq1 != seq2);
+
+    return seq1;
+}
+
+/* Decode the varint size header of a frame from its first len bytes.
+ * Returns the length of the header, -1 if it is not complete */
+static int readHdr(const char *buf, int len, google::protobuf::uint32 *size)
 {
-  google::protobuf::uint32 size;
-  google::protobuf::io::ArrayInputStream ais(buf,4);
+  google::protobuf::io::ArrayInputStream ais(buf,len);
   CodedInputStream coded_input(&ais);
-  coded_input.ReadVarint32(&size);//Decode the HDR and get the size
-  ALOGE(" readHdr --   size of payload is %d", size);
-  return size;
+  if (!coded_input.ReadVarint32(size))//Decode the HDR and get the size
+      return -1;
+  GPS_LOG(ANDROID_LOG_DEBUG, " readHdr --   size of payload is %d", *size);
+  return coded_input.CurrentPosition();
 }
 
-void readBody(int csock, google::protobuf::uint32 siz)
-{
-    char c_status[255], c_latitude[255], c_longitude[255], c_altitude[255], c_bearing[255];
+using google::protobuf::internal::WireFormatLite;
+
+/* Look for the optional GPS_PAYLOAD_TIME_FIELD of the GPS payload in an
+ * encoded sensors_packet, the generated parser drops unknown fields.
+ * Returns 0 if there is none. */
+static int64_t read_payload_time(const char *buf, int len) {
+    CodedInputStream in((const google::protobuf::uint8 *)buf, len);
+    google::protobuf::uint32 tag, size;
+    google::protobuf::uint64 time_ms;
+
+    while ((tag = in.ReadTag()) != 0) {
+        if (WireFormatLite::GetTagFieldNumber(tag) != sensors_packet::kGpsFieldNumber ||
+            WireFormatLite::GetTagWireType(tag) != WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+            if (!WireFormatLite::SkipField(&in, tag))
+                return 0;
+            continue;
+        }
 
-    int bytecount;
-    sensors_packet payload;
-    char* buffer = (char*) calloc(siz+4, sizeof(char));//size of the payload and hdr
-    //Read the entire buffer including the hdr
-    if ((bytecount = recv(csock, (void*) buffer, 4+siz, MSG_WAITALL))== -1)
-    {
-        ALOGE(" readBody: error receiving data (%d)", errno);
-        free((void*) buffer);
-        return;
-    }
-    else if (bytecount != siz+4)
-    {
-        ALOGE(" readBody: Expected to read %d bytes, received %d", siz+4, bytecount);
-        free((void*) buffer);
-        return;
+        if (!in.ReadVarint32(&size))
+            return 0;
+        CodedInputStream::Limit limit = in.PushLimit(size);
+        while ((tag = in.ReadTag()) != 0) {
+            if (tag == WireFormatLite::MakeTag(GPS_PAYLOAD_TIME_FIELD, WireFormatLite::WIRETYPE_VARINT))
+                return in.ReadVarint64(&time_ms) ? (int64_t)time_ms : 0;
+            if (!WireFormatLite::SkipField(&in, tag))
+                return 0;
+        }
+        in.PopLimit(limit);
     }
-    ALOGE(" readBody --  Second read byte count is %d",bytecount);
+    return 0;
+}
+
+/* Decode a frame of len bytes: the varint size then the sensors_packet.
+ * Returns 0 and fills fix when it holds a GPS payload */
+static int decodeBody(const char *buffer, int len, gps_fix *fix)
+{
+    google::protobuf::uint32 siz;
+    sensors_packet payload;
+    int hdr;
     //Assign ArrayInputStream with enough memory
-    google::protobuf::io::ArrayInputStream ais(buffer, siz+4);
+    google::protobuf::io::ArrayInputStream ais(buffer, len);
     CodedInputStream coded_input(&ais);
     //Read an unsigned integer with Varint encoding, truncating to 32 bits.
-    coded_input.ReadVarint32(&siz);
+    // The header may be padded, the payload starts where the varint ended
+    if (!coded_input.ReadVarint32(&siz) || (hdr = coded_input.CurrentPosition()) + siz > (unsigned)len) {
+        GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 1000, " decodeBody: truncated frame of %d bytes", len);
+        return -1;
+    }
     //After the message's length is read, PushLimit() is used to prevent the CodedInputStream
     //from reading beyond that length.Limits are used when parsing length-delimited
     //embedded messages
@@ -82,32 +159,245 @@ void readBody(int csock, google::protobuf::uint32 siz)
 
     if (payload.has_gps() ){
 
-        if (payload.gps().status() == sensors_packet_GPSPayload_GPSStatusType_ENABLED )
-            strcpy(c_status, GPS_ENABLED);
-        else
-            strcpy(c_status, GPS_DISABLED);
+        fix->enabled = (payload.gps().status() == sensors_packet_GPSPayload_GPSStatusType_ENABLED);
+        // The only conversion from floating point, everything after is exact
+        fix->latitude = llround(payload.gps().latitude() * GPS_COORD_SCALE);
+        fix->longitude = llround(payload.gps().longitude() * GPS_COORD_SCALE);
+        fix->altitude = payload.gps().altitude();
+        fix->bearing = payload.gps().bearing();
+        fix->time_ms = read_payload_time(buffer + hdr, siz);
 
-        sprintf(c_latitude ,"%lf",payload.gps().latitude()  );
-        sprintf(c_longitude,"%lf",payload.gps().longitude() );
-        sprintf(c_altitude ,"%lf",payload.gps().altitude() );
-        sprintf(c_bearing  ,"%lf",payload.gps().bearing() );
+    }else{
+        GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 1000, " Unpack_sensor_data_GPS: incorrect message ");
+        return -1;
+    }
+    return 0;
+}
 
-        property_set(GPS_STATUS , GPS_ENABLED);
-        property_set(GPS_LATITUDE   , c_latitude);
-        property_set(GPS_LONGITUDE  , c_longitude);
-        property_set(GPS_ALTITUDE   , c_altitude);
-        property_set(GPS_BEARING    , c_bearing);
+/* Fixes are numbered from their decoding, by the ingest thread only */
+static unsigned fix_seq;
 
-        SLOGE("  unpack_gps_data -  GPS_LATITUDE=%lf - GPS_LONGITUDE=%lf - GPS_ALTITUDE=%lf - GPS_BEARING=%lf", \
-                payload.gps().latitude(),payload.gps().longitude(), payload.gps().altitude(), payload.gps().bearing());
+/* decodeBody() as a trace event of the fix */
+static int decode_frame(const char *buffer, int len, gps_fix *fix) {
+    unsigned seq = ++fix_seq;
+    int ret;
 
-        SLOGE("  unpack_gps_data -  GPS_LATITUDE=%s - GPS_LONGITUDE=%s - GPS_ALTITUDE=%s - GPS_BEARING=%s", \
-                GPS_LATITUDE, GPS_LONGITUDE, GPS_ALTITUDE, GPS_BEARING);
+    GPS_TRACE_BEGIN("gps decode", seq);
+    ret = decodeBody(buffer, len, fix);
+    fix->seq = seq;
+    GPS_TRACE_END();
+    return ret;
+}
 
-    }else{
-        ALOGE(" Unpack_sensor_data_GPS: incorrect message ");
+/* Read a frame of a hdr bytes header and a siz bytes payload.
+ * Returns 0 and fills fix when a GPS payload was read */
+int readBody(int csock, int hdr, google::protobuf::uint32 siz, gps_fix *fix)
+{
+    int bytecount, ret;
+    char* buffer = (char*) calloc(siz+hdr, sizeof(char));//size of the payload and hdr
+    //Read the entire buffer including the hdr
+    if ((bytecount = recv(csock, (void*) buffer, hdr+siz, MSG_WAITALL))== -1)
+    {
+        GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 1000, " readBody: error receiving data (%d)", errno);
+        free((void*) buffer);
+        return -1;
+    }
+    else if (bytecount != siz+hdr)
+    {
+        GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 1000, " readBody: Expected to read %d bytes, received %d", siz+hdr, bytecount);
+        free((void*) buffer);
+        return -1;
     }
+    GPS_LOG(ANDROID_LOG_DEBUG, " readBody --  Second read byte count is %d",bytecount);
+    ret = decode_frame(buffer, siz+hdr, fix);
     free((void*) buffer);
+    return ret;
+}
+
+static gps_capture capture;
+
+/* Properties published by the ingest thread, set only when they change */
+static cached_property pub_status, pub_latitude, pub_longitude, pub_altitude, pub_bearing;
+
+/* Write fixed point degrees as a decimal string, without rounding */
+static void format_coord(char *buf, size_t size, int64_t coord) {
+    uint64_t mag = (coord < 0) ? -(uint64_t)coord : coord;
+
+    snprintf(buf, size, "%s%llu.%09llu", (coord < 0) ? "-" : "",
+            (unsigned long long)(mag / GPS_COORD_SCALE),
+            (unsigned long long)(mag % GPS_COORD_SCALE));
+}
+
+/* NMEA coordinate: degrees, minutes and a fraction of minute */
+typedef struct {
+    int deg;
+    int min;
+    int frac;
+    char hemi;
+} nmea_coord;
+
+/* Split fixed point degrees for NMEA, with decimals digits of minutes
+ * rounded to the nearest. Integer only, so there is no drift. */
+static void to_nmea_coord(int64_t coord, int decimals, char pos, char neg, nmea_coord *out) {
+    uint64_t mag = (coord < 0) ? -(uint64_t)coord : coord;
+    uint64_t unit = GPS_COORD_SCALE;
+    uint64_t frac_per_min = 1;
+    uint64_t frac;
+
+    for (int i = 0; i < decimals; i++) {
+        unit /= 10;
+        frac_per_min *= 10;
+    }
+
+    // minutes in units of 10^-decimals
+    frac = (mag * 60 + unit / 2) / unit;
+
+    out->deg = frac / (60 * frac_per_min);
+    frac %= 60 * frac_per_min;
+    out->min = frac / frac_per_min;
+    out->frac = frac % frac_per_min;
+    out->hemi = (coord < 0) ? neg : pos;
+}
+
+/* Append the checksum and the line end to a sentence of len bytes */
+static int nmea_terminate(char *buf, int len, int size) {
+    if (len < 0 || len + 5 > size)
+        return -1;
+    return len + snprintf(buf + len, size - len, "*%02X\n", nmea_checksum(buf + 1, buf + len));
+}
+
+/* Sentences of the last epoch, with what they were encoded from. While the
+ * fix does not change, only the time, the date and the checksum are
+ * patched in place. XOR being linear, the checksum is updated from the
+ * bytes replaced only. */
+typedef struct {
+    int valid;
+    int64_t latitude;
+    int64_t longitude;
+    double altitude;
+    double bearing;
+    int precision;
+    char gga[128];
+    int len_gga;
+    unsigned sum_gga;
+    char rmc[128];
+    int len_rmc;
+    unsigned sum_rmc;
+    int rmc_date;               /* offset of the ddmmyy field */
+    int64_t day;                /* of the date field, days since the epoch */
+} nmea_cache;
+
+#define NMEA_TIME_OFFSET  7     /* hhmmss.sss, right after "$GPxxx," */
+#define NMEA_RMC_DATE     9     /* field index of the date in RMC */
+
+static int nmea_cache_match(const nmea_cache *c, const gps_fix *fix, int precision) {
+    return c->valid && c->latitude == fix->latitude && c->longitude == fix->longitude &&
+        c->altitude == fix->altitude && c->bearing == fix->bearing && c->precision == precision;
+}
+
+static void put_digits(char *p, unsigned value, int n) {
+    while (n-- > 0) {
+        p[n] = '0' + value % 10;
+        value /= 10;
+    }
+}
+
+/* Replace n bytes at offset of a terminated sentence, fixing its checksum */
+static void nmea_patch(char *buf, int len, unsigned *sum, int offset, const char *field, int n) {
+    static const char hex[] = "0123456789ABCDEF";
+
+    for (int i = 0; i < n; i++) {
+        *sum ^= (unsigned char)buf[offset + i] ^ (unsigned char)field[i];
+        buf[offset + i] = field[i];
+    }
+    // "*XX\n"
+    buf[len - 3] = hex[*sum >> 4];
+    buf[len - 2] = hex[*sum & 15];
+}
+
+/* Remember the sentences just encoded from fix */
+static void nmea_cache_store(nmea_cache *c, const gps_fix *fix, int precision, int64_t utc_ms) {
+    int field = 0, i;
+
+    for (i = 0; i < c->len_rmc && field < NMEA_RMC_DATE; i++)
+        field += (c->rmc[i] == ',');
+
+    c->valid = (field == NMEA_RMC_DATE);
+    c->latitude = fix->latitude;
+    c->longitude = fix->longitude;
+    c->altitude = fix->altitude;
+    c->bearing = fix->bearing;
+    c->precision = precision;
+    c->sum_gga = nmea_checksum(c->gga + 1, c->gga + c->len_gga - 4);
+    c->sum_rmc = nmea_checksum(c->rmc + 1, c->rmc + c->len_rmc - 4);
+    c->rmc_date = i;
+    c->day = utc_ms / 1000 / 86400;
+}
+
+/* Move the cached sentences to utc_ms. gmtime_r() only runs on a new day */
+static void nmea_cache_retime(nmea_cache *c, int64_t utc_ms) {
+    int64_t secs = utc_ms / 1000;
+    int64_t day = secs / 86400;
+    unsigned sod = secs % 86400;
+    char field[10];
+
+    put_digits(field, sod / 3600, 2);
+    put_digits(field + 2, sod / 60 % 60, 2);
+    put_digits(field + 4, sod % 60, 2);
+    field[6] = '.';
+    put_digits(field + 7, utc_ms % 1000, 3);
+
+    nmea_patch(c->gga, c->len_gga, &c->sum_gga, NMEA_TIME_OFFSET, field, 10);
+    nmea_patch(c->rmc, c->len_rmc, &c->sum_rmc, NMEA_TIME_OFFSET, field, 10);
+
+    if (day != c->day) {
+        time_t utc = secs;
+        struct tm tm;
+
+        if (gmtime_r(&utc, &tm) == NULL)
+            return;
+        put_digits(field, tm.tm_mday, 2);
+        put_digits(field + 2, tm.tm_mon + 1, 2);
+        put_digits(field + 4, tm.tm_year % 100, 2);
+        nmea_patch(c->rmc, c->len_rmc, &c->sum_rmc, c->rmc_date, field, 6);
+        c->day = day;
+    }
+}
+
+/* Publish a fix from the simulator, or from a capture being replayed */
+static void ingest_fix(const gps_fix *fix, void *arg) {
+    char c_latitude[255], c_longitude[255], c_altitude[255], c_bearing[255];
+    int64_t now_ns = gps_clock_ns(CLOCK_MONOTONIC);
+    gps_fix stamped = *fix;
+
+    // Replayed fixes were not decoded
+    if (stamped.seq == 0)
+        stamped.seq = ++fix_seq;
+    GPS_TRACE_BEGIN("gps store", stamped.seq);
+
+    capture_fix(&capture, fix, now_ns);
+
+    // Without a time from the simulator, the fix is as old as its arrival
+    stamped.received_ms = now_ns / 1000000;
+    if (stamped.time_ms == 0)
+        stamped.time_ms = gps_clock_ms(CLOCK_REALTIME);
+
+    format_coord(c_latitude, sizeof(c_latitude), fix->latitude);
+    format_coord(c_longitude, sizeof(c_longitude), fix->longitude);
+    sprintf(c_altitude ,"%lf",fix->altitude );
+    sprintf(c_bearing  ,"%lf",fix->bearing );
+
+    cached_property_set(&pub_status, GPS_ENABLED);
+    cached_property_set(&pub_latitude, c_latitude);
+    cached_property_set(&pub_longitude, c_longitude);
+    cached_property_set(&pub_altitude, c_altitude);
+    cached_property_set(&pub_bearing, c_bearing);
+
+    GPS_LOG(ANDROID_LOG_DEBUG, "  unpack_gps_data -  GPS_LATITUDE=%s - GPS_LONGITUDE=%s - GPS_ALTITUDE=%s - GPS_BEARING=%s",
+            c_latitude, c_longitude, c_altitude, c_bearing);
+
+    fix_slot_store(&latest_fix, &stamped);
+    GPS_TRACE_END();
 }
 
 
@@ -137,15 +427,59 @@ static int start_server(uint16_t port) {
     return server;
 }
 
-static int wait_for_client(int server) {
+/* abstract unix socket for the HAL, see GPS_SOCKET_NAME */
+static int start_local_server(const char *name) {
+    int server = -1;
+    struct sockaddr_un srv_addr;
+    socklen_t len;
+
+    bzero(&srv_addr, sizeof(srv_addr));
+    srv_addr.sun_family = AF_UNIX;
+    strcpy(srv_addr.sun_path + 1, name);
+    len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name);
+
+    if ((server = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0) {
+        SLOGE(" GPS Unable to create local socket, errno=%d\n", errno);
+        return -1;
+    }
+
+    if (bind(server, (struct sockaddr *)&srv_addr, len) < 0) {
+        SLOGE(" GPS Unable to bind local socket, errno=%d\n", errno);
+        close(server);
+        return -1;
+    }
+
+    return server;
+}
+
+/* wait for the HAL on the TCP server or, if available, the local server */
+static int wait_for_hal(int server, int local_server) {
     int client = -1;
+    int ready;
+    fd_set fds;
 
-    if (listen(server, 1) < 0) {
+    if (listen(server, 1) < 0 || (local_server != -1 && listen(local_server, 1) < 0)) {
         SLOGE("Unable to listen to socket, errno=%d\n", errno);
         return -1;
     }
 
-    client = accept(server, NULL, 0);
+    do {
+        FD_ZERO(&fds);
+        FD_SET(server, &fds);
+        if (local_server != -1)
+            FD_SET(local_server, &fds);
+        ready = select((server > local_server ? server : local_server) + 1, &fds, NULL, NULL, NULL);
+    } while (ready < 0 && errno == EINTR);
+
+    if (ready < 0) {
+        SLOGE("Unable to wait for main connection, errno=%d\n", errno);
+        return -1;
+    }
+
+    if (local_server != -1 && FD_ISSET(local_server, &fds))
+        client = accept(local_server, NULL, 0);
+    else
+        client = accept(server, NULL, 0);
 
     if (client < 0) {
         SLOGE("Unable to accept socket for main conection, errno=%d\n", errno);
@@ -155,176 +489,785 @@ static int wait_for_client(int server) {
     return client;
 }
 
+/* UDP socket for the simulator, one frame per datagram */
+static int start_udp_server(uint16_t port) {
+    int server = -1;
+    struct sockaddr_in srv_addr;
+
+    bzero(&srv_addr, sizeof(srv_addr));
+    srv_addr.sin_family = AF_INET;
+    srv_addr.sin_addr.s_addr = INADDR_ANY;
+    srv_addr.sin_port = htons(port);
+
+    if ((server = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        SLOGE(" GPS Unable to create UDP socket, errno=%d\n", errno);
+        return -1;
+    }
+
+    if (bind(server, (struct sockaddr *)&srv_addr, sizeof(srv_addr)) < 0) {
+        SLOGE(" GPS Unable to bind UDP socket, errno=%d\n", errno);
+        close(server);
+        return -1;
+    }
+
+    return server;
+}
+
+/* Output stage: every consumer gets the sentences of an epoch (one fix)
+ * through a single sendmsg(). Sockets are non-blocking so a stalled client
+ * never delays the others: what can't be written is queued, with room for
+ * the epoch being written and the latest one only. An older epoch still
+ * waiting when a new one comes is dropped and counted.
+ * Clients get epochs only while active: the HAL stops and starts its
+ * session with GPS_SESSION_STOP / GPS_SESSION_START, with nobody active
+ * no epoch is built at all. */
+typedef struct {
+    int fd;
+    int stream;                             /* TCP: writes can be partial */
+    int active;                             /* wants epochs */
+    char inflight[GPS_MAX_MESSAGE_SIZE];    /* epoch being written */
+    int inflight_len;
+    int inflight_off;
+    char pending[GPS_MAX_MESSAGE_SIZE];     /* latest epoch waiting */
+    int pending_len;
+    unsigned long drops;
+} gps_client;
+
+typedef struct {
+    gps_client clients[GPS_MAX_CLIENTS];
+    int count;
+} gps_output;
+
+static long long monotonic_ms() {
+    return gps_clock_ms(CLOCK_MONOTONIC);
+}
+
+static void output_add_client(gps_output *out, int fd) {
+    gps_client *c;
+    int type = SOCK_STREAM;
+    socklen_t len = sizeof(type);
+    int yes = 1;
+
+    if (out->count >= GPS_MAX_CLIENTS) {
+        SLOGE("GPS:: Too many clients, connection refused");
+        close(fd);
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len);
+
+    c = &out->clients[out->count++];
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->stream = (type == SOCK_STREAM);
+    c->active = 1;
+
+    // An epoch is written at once, don't let Nagle hold it back
+    if (c->stream)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    GPS_LOG(ANDROID_LOG_INFO, "GPS:: New client %d (%s)", fd, c->stream ? "TCP" : "local");
+}
+
+static void output_remove_client(gps_output *out, int i) {
+    gps_client *c = &out->clients[i];
+
+    GPS_LOG(ANDROID_LOG_INFO, "GPS:: Client %d gone, %lu epochs dropped", c->fd, c->drops);
+    close(c->fd);
+    out->clients[i] = out->clients[--out->count];
+}
+
+/* Returns the number of bytes written, 0 if the socket is full, -1 on error */
+static int client_write(gps_client *c, const struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    int ret;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    do {
+        ret = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        GPS_LOG(ANDROID_LOG_ERROR, "GPS:: Can't send to client %d, errno=%d", c->fd, errno);
+        return -1;
+    }
+    return ret;
+}
+
+/* Write what is queued for the client, returns -1 on error */
+static int client_flush(gps_client *c) {
+    struct iovec iov;
+    int ret;
+
+    while (c->inflight_len > 0) {
+        iov.iov_base = c->inflight + c->inflight_off;
+        iov.iov_len = c->inflight_len - c->inflight_off;
+        if ((ret = client_write(c, &iov, 1)) <= 0)
+            return ret;
+
+        c->inflight_off += ret;
+        if (c->inflight_off < c->inflight_len)
+            return 0;
+
+        // Done, the pending epoch is next
+        memcpy(c->inflight, c->pending, c->pending_len);
+        c->inflight_len = c->pending_len;
+        c->inflight_off = 0;
+        c->pending_len = 0;
+    }
+    return 0;
+}
+
+static int gather(char *dst, const struct iovec *iov, int iovcnt) {
+    int len = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dst + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+static int output_active(const gps_output *out) {
+    for (int i = 0; i < out->count; i++)
+        if (out->clients[i].active)
+            return 1;
+    return 0;
+}
+
+/* Read session commands from a client. Returns 0 if it closed, -1 on
+ * error, 1 otherwise and sets *started if it (re)started a session. */
+static int client_read(gps_client *c, int *started) {
+    char cmd[64];
+    int ret;
+
+    do {
+        ret = recv(c->fd, cmd, sizeof(cmd), MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+
+    for (int i = 0; i < ret; i++) {
+        if (cmd[i] == GPS_SESSION_START && !c->active) {
+            c->active = 1;
+            *started = 1;
+        } else if (cmd[i] == GPS_SESSION_STOP && c->active) {
+            // Nothing more for it, an epoch half written still completes
+            c->active = 0;
+            c->pending_len = 0;
+        }
+    }
+    if (ret > 0)
+        GPS_LOG(ANDROID_LOG_INFO, "GPS:: Client %d session %s", c->fd, c->active ? "started" : "stopped");
+    return (ret == 0) ? 0 : 1;
+}
+
+/* Send an epoch to every active client, its size must fit in GPS_MAX_MESSAGE_SIZE */
+static void output_send_epoch(gps_output *out, const struct iovec *iov, int iovcnt) {
+    int i = 0;
+
+    while (i < out->count) {
+        gps_client *c = &out->clients[i];
+        int ret = 0;
+
+        if (!c->active) {
+            i++;
+            continue;
+        }
+
+        if (client_flush(c) < 0) {
+            output_remove_client(out, i);
+            continue;
+        }
+
+        if (c->inflight_len > 0) {
+            // Still busy, keep only this epoch for later
+            if (c->pending_len > 0)
+                c->drops++;
+            c->pending_len = gather(c->pending, iov, iovcnt);
+        } else if ((ret = client_write(c, iov, iovcnt)) < 0) {
+            output_remove_client(out, i);
+            continue;
+        } else {
+            c->inflight_len = gather(c->inflight, iov, iovcnt);
+            c->inflight_off = ret;
+            if (c->inflight_off == c->inflight_len)
+                c->inflight_len = 0;
+        }
+        i++;
+    }
+}
+
+/* Serve the clients for timeout_ms: accept new ones, write what is queued,
+ * read their session commands and notice the ones that went away. With a
+ * negative timeout, wait until a client is active. Returns 1 early when a
+ * session starts, the caller should emit then, 0 otherwise. */
+static int output_poll(gps_output *out, const int *servers, int nservers, int timeout_ms) {
+    long long deadline = monotonic_ms() + timeout_ms;
+    struct pollfd fds[GPS_MAX_CLIENTS + 3];
+    long long remaining = -1;
+    int clock_fd = gps_clock_fd();
+    int started = 0;
+
+    while (!started && (timeout_ms < 0 ? !output_active(out)
+                        : (remaining = deadline - monotonic_ms()) > 0)) {
+        int nfds = 0;
+        int ready, i;
+
+        for (i = 0; i < nservers; i++) {
+            fds[nfds].fd = servers[i];
+            fds[nfds].events = (servers[i] != -1) ? POLLIN : 0;
+            fds[nfds++].revents = 0;
+        }
+        for (i = 0; i < out->count; i++) {
+            fds[nfds].fd = out->clients[i].fd;
+            fds[nfds].events = POLLIN | (out->clients[i].inflight_len > 0 ? POLLOUT : 0);
+            fds[nfds++].revents = 0;
+        }
+
+        // A virtual clock may reach the deadline before poll() times out
+        if (clock_fd != -1) {
+            fds[nfds].fd = clock_fd;
+            fds[nfds].events = POLLIN;
+            fds[nfds++].revents = 0;
+        }
+
+        ready = poll(fds, nfds, (int)remaining);
+        if (ready < 0 && errno != EINTR) {
+            GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 1000, "GPS:: poll failed, errno=%d", errno);
+            return 0;
+        }
+        if (ready <= 0)
+            continue;
+        if (clock_fd != -1 && (fds[nfds - 1].revents & POLLIN))
+            gps_clock_ack();
+
+        // Clients first, indexes change when one is removed
+        for (i = out->count - 1; i >= 0; i--) {
+            short revents = fds[nservers + i].revents;
+            gps_client *c = &out->clients[i];
+            int gone = (revents & (POLLERR | POLLHUP)) != 0;
+
+            if (!gone && (revents & POLLIN))
+                gone = (client_read(c, &started) <= 0);
+            if (!gone && (revents & POLLOUT))
+                gone = (client_flush(c) < 0);
+            if (gone)
+                output_remove_client(out, i);
+        }
+
+        for (i = 0; i < nservers; i++) {
+            if (fds[i].revents & POLLIN) {
+                int fd = accept(servers[i], NULL, 0);
+                if (fd >= 0)
+                    output_add_client(out, fd);
+            }
+        }
+
+        // Back to waiting for the HAL
+        if (out->count == 0)
+            break;
+    }
+    return started;
+}
+
+#define GPS_MAX_FRAME_HDR  5      /* bytes of a varint32 */
+
+/* Read a frame from a simulator connection, returns -1 once it is closed */
+static int ingest_frame(int sim_client) {
+    char buffer[GPS_MAX_FRAME_HDR];
+    google::protobuf::uint32 framing_size;
+    int bytecount, hdr = -1;
+    gps_fix fix;
+
+    // Peek into the socket a byte more each time, until the header of the
+    // packet size is complete: it is as short as the simulator made it
+    for (int want = 1; hdr < 0 && want <= GPS_MAX_FRAME_HDR; want++) {
+        if ((bytecount = recv(sim_client, buffer, want, MSG_PEEK | MSG_WAITALL)) == -1) {
+            GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 1000, "GPS::  Error receiving data, errno=%d", errno);
+            return -1;
+        }
+        if (bytecount < want)
+            return -1;
+        if (!(buffer[want - 1] & 0x80))
+            hdr = readHdr(buffer, want, &framing_size);
+    }
+    if (hdr < 0) {
+        GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 1000, "GPS:: Invalid frame header");
+        return -1;
+    }
+
+    GPS_LOG(ANDROID_LOG_DEBUG, "GPS:: Frame header of %d bytes", hdr);
+    if (framing_size >= 4*1024*1024) { // Don't expect protobufs > 4MiB
+        GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 1000, "GPS:: Framing size too big (%d)", framing_size);
+        return -1;
+    }
+    if (readBody(sim_client, hdr, framing_size, &fix) == 0)
+        ingest_fix(&fix, NULL);
+    return 0;
+}
+
+/* Drain the UDP socket in batches. Of all the fixes queued only the newest
+ * is applied: datagrams may be reordered, so that is the latest simulator
+ * time, or the last received for fixes without one. */
+static void ingest_datagrams(int udp) {
+    static char buffers[GPS_UDP_BATCH][GPS_MAX_DATAGRAM];
+    struct mmsghdr msgs[GPS_UDP_BATCH];
+    struct iovec iovs[GPS_UDP_BATCH];
+    gps_fix fix, newest;
+    int have = 0, received = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < GPS_UDP_BATCH; i++) {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = sizeof(buffers[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (;;) {
+        int n = recvmmsg(udp, msgs, GPS_UDP_BATCH, MSG_DONTWAIT, NULL);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 1000, "GPS:: recvmmsg failed, errno=%d", errno);
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+                decode_frame(buffers[i], msgs[i].msg_len, &fix) < 0)
+                continue;
+            if (have && fix.time_ms != 0 && fix.time_ms < newest.time_ms)
+                continue;
+            newest = fix;
+            have = 1;
+        }
+        received += n;
+
+        if (n < GPS_UDP_BATCH)
+            break;
+    }
+
+    if (!have)
+        return;
+
+    GPS_LOG(ANDROID_LOG_DEBUG, "GPS:: %d datagrams, applying the newest fix", received);
+    ingest_fix(&newest, NULL);
+}
+
+typedef struct {
+    int tcp;
+    int udp;                    /* -1 without UDP ingestion */
+} ingest_sockets;
+
+/* Ingest thread: reads simulator frames and publishes the latest fix.
+ * A simulator client may send one frame per connection or keep the
+ * connection open, frames are read until it closes. Datagrams are read
+ * meanwhile, this thread is the only writer of the latest fix. */
+static void *ingest_thread(void *arg) {
+    ingest_sockets *sim = (ingest_sockets *)arg;
+    int sim_client = -1;
+    struct pollfd fds[2];
+
+    if (listen(sim->tcp, 1) < 0) {
+        SLOGE("Unable to listen to socket, errno=%d\n", errno);
+        return NULL;
+    }
+
+    for (;;) {
+        fds[0].fd = (sim_client != -1) ? sim_client : sim->tcp;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = sim->udp;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        // Wakes up to write captured records the simulator left waiting
+        if (poll(fds, 2, capture_timeout_ms(&capture, gps_clock_ns(CLOCK_MONOTONIC))) < 0) {
+            if (errno == EINTR)
+                continue;
+            SLOGE("GPS:: poll failed, errno=%d", errno);
+            break;
+        }
+        capture_tick(&capture, gps_clock_ns(CLOCK_MONOTONIC));
+
+        if (fds[1].revents & POLLIN)
+            ingest_datagrams(sim->udp);
+
+        if (fds[0].revents == 0)
+            continue;
+
+        if (sim_client == -1) {
+            if ((sim_client = accept(sim->tcp, NULL, 0)) < 0)
+                GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 1000, "Unable to accept simulator connection, errno=%d", errno);
+        } else if (ingest_frame(sim_client) < 0) {
+            close(sim_client);
+            sim_client = -1;
+        }
+    }
+
+    SLOGE("GPS:: Simulator ingestion stopped");
+    return NULL;
+}
+
+typedef struct {
+    const char *path;
+    double speed;
+} replay_args;
+
+/* Replay thread: feeds a capture instead of reading the simulator */
+static void *replay_thread(void *arg) {
+    replay_args *replay = (replay_args *)arg;
+    int count = capture_replay(replay->path, replay->speed, ingest_fix, NULL);
+
+    SLOGI("GPS:: Replayed %d fixes from %s", count, replay->path);
+    return NULL;
+}
+
+#define GPS_SHM_WAIT_MS   1000 /* for the ring, and between attempts to open it */
+
+/* Shared memory thread: takes the newest sample of the ring each time the
+ * producer publishes. Replaces the ingest thread, so that there is still
+ * a single writer of the latest fix. */
+static void *shm_thread(void *arg) {
+    const char *path = (const char *)arg;
+    gps_shm_ring *ring;
+    uint32_t seen = 0;
+    gps_fix fix;
+
+    while (shm_ring_open(path, &ring) < 0) {
+        GPS_LOG_LIMIT(ANDROID_LOG_INFO, 60000, "GPS:: Waiting for the sample ring %s", path);
+        usleep(GPS_SHM_WAIT_MS * 1000);
+    }
+    SLOGI("GPS:: Reading samples from %s", path);
+
+    for (;;) {
+        capture_tick(&capture, gps_clock_ns(CLOCK_MONOTONIC));
+        if (!shm_ring_wait(ring, &seen, GPS_SHM_WAIT_MS))
+            continue;
+        if (shm_ring_latest(ring, &fix) == 0)
+            ingest_fix(&fix, NULL);
+    }
+    return NULL;
+}
+
+static void noise_configure(gps_noise *noise) {
+    char value[PROPERTY_VALUE_MAX];
+    unsigned long long seed;
+
+    property_get(GPS_NOISE_SEED_PROPERTY, value, "");
+    if (sscanf(value, "%llu", &seed) != 1) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed = ((unsigned long long)ts.tv_sec << 32) ^ ts.tv_nsec ^ getpid();
+    }
+    noise_init(noise, seed);
+
+    property_get(GPS_NOISE_PROPERTY, value, "0");
+    noise->enabled = (strcmp(value, "1") == 0);
+
+    property_get(GPS_NOISE_WALK_PROPERTY, value, "");
+    if (sscanf(value, "%lf,%lf", &noise->walk_sigma, &noise->walk_tau) != 2)
+        noise->walk_sigma = noise->walk_tau = 0.;
+
+    property_get(GPS_NOISE_MULTIPATH_PROPERTY, value, "");
+    if (sscanf(value, "%lf,%lf", &noise->multipath_prob, &noise->multipath_m) != 2)
+        noise->multipath_prob = noise->multipath_m = 0.;
+
+    property_get(GPS_NOISE_OUTAGE_PROPERTY, value, "");
+    if (sscanf(value, "%d,%d", &noise->outage_period, &noise->outage_duration) != 2)
+        noise->outage_period = noise->outage_duration = 0;
+
+    if (noise->enabled)
+        SLOGI("GPS:: Noise enabled, seed %llu", seed);
+}
+
 int main(int argc, char *argv[]) {
-    int server = -1; int sim_server = -1;
-    int client = -1; int sim_client = -1;
-
-    char gps_latitude[PROPERTY_VALUE_MAX];
-    char gps_longitude[PROPERTY_VALUE_MAX];
-    char gps_altitude[PROPERTY_VALUE_MAX];
-    char gps_bearing[PROPERTY_VALUE_MAX];
-    char gps_status[PROPERTY_VALUE_MAX];
-    char gps_precision[PROPERTY_VALUE_MAX];
-    char gpgga[128];
-    char gprmc[128];
-
-    double i_lat=0., i_lng=0., i_alt=0., i_bearing=0.;
-    double o_lat, o_lng, o_alt;
-    int o_latdeg, o_latmin, o_lngdeg, o_lngmin;
-    char o_clat, o_clng;
-
-    char buffer[4];
-    int bytecount=0;
+    int server = -1; int sim_server = -1; int local_server = -1;
+    int client = -1;
+
+    cached_property gps_status, gps_precision, gps_trace;
+    int enabled;
+    float precision;
+    nmea_cache sentences;
+
+    nmea_coord o_lat, o_lng;
+    char gps_decimals[PROPERTY_VALUE_MAX];
+    int decimals;
+
+    gps_output output;
+    int hal_servers[2];
+    struct iovec epoch[3];
+    char trace_sentence[32];
+    int nepoch;
+    int len_gga, len_rmc;
+    char *gpgga = sentences.gga, *gprmc = sentences.rmc;
+
+    pthread_t ingest;
+    ingest_sockets sim;
+    char udp_value[PROPERTY_VALUE_MAX];
+    gps_fix fix;
+    long long next_emit, now, due;
+    int timeout;
+
+    char lowjitter_value[PROPERTY_VALUE_MAX];
+    int lowjitter;
+    jitter_histogram jitter;
+    gps_noise noise;
+
+    char capture_path[PROPERTY_VALUE_MAX];
+    char shm_path[PROPERTY_VALUE_MAX];
+    replay_args replay = { NULL, 1. };
+
+    // local_gps --replay <capture> [speed factor, 0 for no delay]
+    if (argc >= 3 && strcmp(argv[1], "--replay") == 0) {
+        replay.path = argv[2];
+        if (argc >= 4)
+            replay.speed = atof(argv[3]);
+    }
+
+    // Before any thread is created, see gps_log_init()
+    gps_log_init();
+    gps_clock_setup();
+
+    output.count = 0;
 
     if ((server = start_server(GPS_PORT)) == -1) {
         SLOGE(" GPS Unable to create socket\n");
         return 1;
     }
 
-    property_get(GPS_STATUS, gps_status, GPS_DEFAULT_STATUS);
+    // TCP stays the fallback if the local socket can't be created
+    if ((local_server = start_local_server(GPS_SOCKET_NAME)) == -1)
+        SLOGE(" GPS Unable to create local socket, TCP only\n");
 
     property_set(GPS_LATITUDE, "0");
     property_set(GPS_LONGITUDE, "0");
     property_set(GPS_ALTITUDE, "0");
     property_set(GPS_BEARING, "0");
 
+    // Read once here, then only when the property service changes them
+    cached_property_init(&gps_status, GPS_STATUS, GPS_DEFAULT_STATUS);
+    cached_property_init(&gps_precision, GPS_ACCURACY, GPS_DEFAULT_ACCURACY);
+    cached_property_init(&gps_trace, GPS_TRACE_PROPERTY, "0");
+    gps_trace_setup(strcmp(gps_trace.value, "1") == 0);
+    enabled = (strcmp(gps_status.value, GPS_ENABLED) == 0);
+    precision = atof(gps_precision.value);
+    cached_property_init(&pub_status, GPS_STATUS, GPS_DEFAULT_STATUS);
+    cached_property_init(&pub_latitude, GPS_LATITUDE, "0");
+    cached_property_init(&pub_longitude, GPS_LONGITUDE, "0");
+    cached_property_init(&pub_altitude, GPS_ALTITUDE, "0");
+    cached_property_init(&pub_bearing, GPS_BEARING, "0");
+
 
     if ((sim_server = start_server(SIM_GPS_PORT)) == -1) {
         SLOGE(" GPS Unable to create socket\n");
         return 1;
     }
 
-    // Listen for main connection
-    while ((client = wait_for_client(server)) != -1) {
-
-        while (1) {
-            // Update GPS info every GPS_UPDATE_PERIOD seconds
-            sleep(GPS_UPDATE_PERIOD*2);
-
-            if (GPS_DEBUG) SLOGD("GPS enabled, parsing properties - %d" , client);
-
-            if ( (sim_client = wait_for_client(sim_server) ) != -1){
-                memset(buffer, '\0', 4);
-
-                //Peek into the socket and get the packet size
-                if((bytecount = recv(sim_client,buffer, 4, MSG_PEEK))== -1)
-                    SLOGE("GPS::  Error receiving data");
-                else if (bytecount == 0)
-                    SLOGE("GPS:: First read byte count is empty");
-                else
-                {
-                    SLOGD("GPS:: First read byte count is %d",bytecount);
-                    google::protobuf::uint32 framing_size = readHdr(buffer);
-                    if (framing_size < 4*1024*1024) // Don't expect protobufs > 4MiB
-                        readBody(sim_client, framing_size);
-                    else
-                    {
-                        SLOGE("GPS:: Framing size too big (%d)", framing_size);
-                        bytecount = 0;
-                    }
-                }
-            }
-            close(sim_client);
+    // Datagrams on the same port number, next to the TCP connections
+    sim.tcp = sim_server;
+    sim.udp = -1;
+    property_get(GPS_UDP_PROPERTY, udp_value, "0");
+    if (strcmp(udp_value, "1") == 0 && (sim.udp = start_udp_server(SIM_GPS_PORT)) == -1)
+        SLOGE(" GPS Unable to create UDP socket, TCP only\n");
+
+    property_get(GPS_NMEA_DECIMALS_PROPERTY, gps_decimals, "");
+    decimals = gps_decimals[0] ? atoi(gps_decimals) : GPS_DEFAULT_NMEA_DECIMALS;
+    if (decimals < 1 || decimals > 7) {
+        SLOGE("Invalid NMEA decimals %s, should be [1..7]", gps_decimals);
+        decimals = GPS_DEFAULT_NMEA_DECIMALS;
+    }
 
-            property_get(GPS_STATUS, gps_status, GPS_DEFAULT_STATUS);
+    noise_configure(&noise);
+    sentences.valid = 0;
 
-            if (bytecount > 0 && strcmp(gps_status, GPS_ENABLED) == 0)
-            {
-                property_get(GPS_LATITUDE, gps_latitude, "0");
-                property_get(GPS_LONGITUDE, gps_longitude, "0");
-                property_get(GPS_ALTITUDE, gps_altitude, "0");
-                property_get(GPS_BEARING, gps_bearing, "0");
-
-                i_lat = atof(gps_latitude);
-                i_lng = atof(gps_longitude);
-                i_alt = atof(gps_altitude);
-                i_bearing = atof(gps_bearing);
-
-                if (i_lat<0) {
-                    o_lat = -i_lat;
-                    o_clat = 'S';
-                } else {
-                    o_lat = i_lat;
-                    o_clat = 'N';
-                }
+    capture.fd = -1;
+    property_get(GPS_CAPTURE_PROPERTY, capture_path, "");
+    if (replay.path == NULL && capture_path[0] != '\0')
+        capture_open(&capture, capture_path);
 
-                o_latdeg = (int)o_lat;
-                o_lat = 60. * (o_lat - (double)o_latdeg);
-                o_latmin = (int) o_lat;
-                o_lat = 10000. * (o_lat - (double)o_latmin);
+    // Simulator frames are read by their own thread, this one only emits
+    property_get(GPS_SHM_PROPERTY, shm_path, "");
+    if (replay.path != NULL) {
+        if (pthread_create(&ingest, NULL, replay_thread, &replay) != 0) {
+            SLOGE(" GPS Unable to start replay thread\n");
+            return 1;
+        }
+    } else if (shm_path[0] != '\0') {
+        if (pthread_create(&ingest, NULL, shm_thread, shm_path) != 0) {
+            SLOGE(" GPS Unable to start shared memory thread\n");
+            return 1;
+        }
+    } else if (pthread_create(&ingest, NULL, ingest_thread, &sim) != 0) {
+        SLOGE(" GPS Unable to start ingest thread\n");
+        return 1;
+    }
 
-                if (i_lng<0) {
-                    o_lng = -i_lng;
-                    o_clng = 'W';
-                } else {
-                    o_lng = i_lng;
-                    o_clng = 'E';
-                }
+    // Only this thread goes real-time, the ingest thread was created before
+    property_get(GPS_LOWJITTER_PROPERTY, lowjitter_value, "0");
+    lowjitter = (strcmp(lowjitter_value, "1") == 0);
+    if (lowjitter) {
+        char value[PROPERTY_VALUE_MAX];
+        int priority, cpu;
+
+        property_get(GPS_RT_PRIORITY_PROPERTY, value, "");
+        priority = value[0] ? atoi(value) : GPS_DEFAULT_RT_PRIORITY;
+        property_get(GPS_RT_CPU_PROPERTY, value, "");
+        cpu = value[0] ? atoi(value) : -1;
+        realtime_setup(priority, cpu);
+    }
+    memset(&jitter, 0, sizeof(jitter));
 
-                o_lngdeg = (int)o_lng;
-                o_lng = 60. * (o_lng - (double)o_lngdeg);
-                o_lngmin = (int) o_lng;
-                o_lng = 10000. * (o_lng - (double)o_lngmin);
+    hal_servers[0] = server;
+    hal_servers[1] = local_server;
 
+    // Listen for main connection
+    while ((client = wait_for_hal(server, local_server)) != -1) {
+
+        output_add_client(&output, client);
+        next_emit = monotonic_ms() + GPS_UPDATE_PERIOD*2*1000;
+
+        while (output.count > 0) {
+            // Update GPS info every GPS_UPDATE_PERIOD seconds, serving clients
+            // meanwhile. No timer at all while no session is started.
+            now = monotonic_ms();
+            timeout = !output_active(&output) ? -1 : (next_emit > now) ? (int)(next_emit - now) : 0;
+            // poll() has a millisecond resolution, low-jitter mode sleeps the
+            // last one to the exact deadline
+            if (lowjitter && timeout > 0)
+                timeout--;
+            if (output_poll(&output, hal_servers, 2, timeout)) {
+                // A session (re)started, give it the last fix right away
+                next_emit = monotonic_ms();
+            }
+            if (lowjitter && output_active(&output))
+                gps_clock_sleep_until(next_emit * 1000000LL);
+
+            now = monotonic_ms();
+            if (!output_active(&output) || now < next_emit)
+                continue;
+            due = next_emit;
+            next_emit += GPS_UPDATE_PERIOD*2*1000;
+            if (next_emit < now)
+                next_emit = now + GPS_UPDATE_PERIOD*2*1000;
+
+            // Parsed again only when they changed
+            if (cached_property_refresh(&gps_status))
+                enabled = (strcmp(gps_status.value, GPS_ENABLED) == 0);
+            if (cached_property_refresh(&gps_precision))
+                precision = atof(gps_precision.value);
+            if (cached_property_refresh(&gps_trace))
+                gps_trace_setup(strcmp(gps_trace.value, "1") == 0);
+
+            if (fix_slot_load(&latest_fix, &fix) != 0 && enabled)
+            {
                 /* HDOP (horizontal dilution of precision) */
-                property_get(GPS_ACCURACY, gps_precision, GPS_DEFAULT_ACCURACY);
-                float precision = atof(gps_precision);
                 if (precision < 0. || precision > 200.) {
-                    SLOGE("Invalid precision %s, should be [0..200]");
+                    GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 10000, "Invalid precision %s, should be [0..200]", gps_precision.value);
                     continue;
                 }
 
-                struct timeval tv;
-                struct tm tm;
-
-                if (gettimeofday(&tv, NULL) == -1) {
-                    SLOGE("gettimeofday");
+                if (noise_apply(&noise, &fix, precision, monotonic_ms()) < 0) {
+                    GPS_LOG(ANDROID_LOG_DEBUG, "GPS outage, fix not emitted");
                     continue;
                 }
 
-                if (!gmtime_r(&tv.tv_sec, &tm)) {
-                    SLOGE("gmtime_r");
-                    continue;
-                }
+                // Time of the fix, moving on while it is emitted again
+                int64_t utc_ms = fix.time_ms + (monotonic_ms() - fix.received_ms);
 
-                snprintf(gpgga, sizeof(gpgga), STRING_GPGGA,
-                        tm.tm_hour, tm.tm_min, tm.tm_sec,
-                        o_latdeg, o_latmin, (int)o_lat, o_clat,
-                        o_lngdeg, o_lngmin, (int)o_lng, o_clng,
-                        (int)precision,
-                        i_alt);
-
-                snprintf(gprmc, sizeof(gprmc), STRING_GPRMC,
-                        tm.tm_hour, tm.tm_min, tm.tm_sec,
-                        o_latdeg, o_latmin, (int)o_lat, o_clat,
-                        o_lngdeg, o_lngmin, (int)o_lng, o_clng,
-                        0.0,
-                        i_bearing,
-                        tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100,
-                        i_bearing);
-
-                if (GPS_DEBUG) {
-                    SLOGD("GGA command : %s", gpgga);
-                    SLOGD("RMC command : %s", gprmc);
-                }
+                // Same fix as the last epoch, nearly always when stationary
+                if (nmea_cache_match(&sentences, &fix, (int)precision)) {
+                    nmea_cache_retime(&sentences, utc_ms);
+                    len_gga = sentences.len_gga;
+                    len_rmc = sentences.len_rmc;
+                } else {
+                    time_t utc = utc_ms / 1000;
+                    struct tm tm;
+
+                    if (!gmtime_r(&utc, &tm)) {
+                        GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 10000, "gmtime_r");
+                        continue;
+                    }
 
-                if (send(client, gpgga, strlen(gpgga), MSG_NOSIGNAL) < 0) {
-                    SLOGE("Can't send GGA command");
-                    break;
+                    to_nmea_coord(fix.latitude, decimals, 'N', 'S', &o_lat);
+                    to_nmea_coord(fix.longitude, decimals, 'E', 'W', &o_lng);
+
+                    len_gga = snprintf(gpgga, sizeof(sentences.gga), STRING_GPGGA,
+                            tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(utc_ms % 1000),
+                            o_lat.deg, o_lat.min, decimals, o_lat.frac, o_lat.hemi,
+                            o_lng.deg, o_lng.min, decimals, o_lng.frac, o_lng.hemi,
+                            (int)precision,
+                            fix.altitude);
+
+                    len_rmc = snprintf(gprmc, sizeof(sentences.rmc), STRING_GPRMC,
+                            tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(utc_ms % 1000),
+                            o_lat.deg, o_lat.min, decimals, o_lat.frac, o_lat.hemi,
+                            o_lng.deg, o_lng.min, decimals, o_lng.frac, o_lng.hemi,
+                            0.0,
+                            fix.bearing,
+                            tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100,
+                            fix.bearing);
+
+                    len_gga = nmea_terminate(gpgga, len_gga, sizeof(sentences.gga));
+                    len_rmc = nmea_terminate(gprmc, len_rmc, sizeof(sentences.rmc));
+                    sentences.valid = 0;
+                    if (len_gga < 0 || len_rmc < 0) {
+                        GPS_LOG_LIMIT(ANDROID_LOG_ERROR, 10000, "NMEA sentence too long, fix not emitted");
+                        continue;
+                    }
+                    sentences.len_gga = len_gga;
+                    sentences.len_rmc = len_rmc;
+                    nmea_cache_store(&sentences, &fix, (int)precision, utc_ms);
                 }
 
-                if (send(client, gprmc, strlen(gprmc), MSG_NOSIGNAL) < 0) {
-                    SLOGE("Can't send RMC command");
-                    break;
+                GPS_LOG(ANDROID_LOG_DEBUG, "GGA command : %.*s", len_gga - 1, gpgga);
+                GPS_LOG(ANDROID_LOG_DEBUG, "RMC command : %.*s", len_rmc - 1, gprmc);
+
+                // All sentences go out in one write per client, the HAL
+                // names its trace events after the first one
+                nepoch = 0;
+                if (GPS_TRACE_ON()) {
+                    int len = snprintf(trace_sentence, sizeof(trace_sentence), GPS_TRACE_SENTENCE ",%u", fix.seq);
+
+                    len = nmea_terminate(trace_sentence, len, sizeof(trace_sentence));
+                    epoch[nepoch].iov_base = trace_sentence;
+                    epoch[nepoch++].iov_len = len;
                 }
+                epoch[nepoch].iov_base = gpgga;
+                epoch[nepoch++].iov_len = len_gga;
+                epoch[nepoch].iov_base = gprmc;
+                epoch[nepoch++].iov_len = len_rmc;
+
+                int64_t sent_ns = gps_clock_ns(CLOCK_MONOTONIC);
+                GPS_TRACE_BEGIN("gps send", fix.seq);
+                output_send_epoch(&output, epoch, nepoch);
+                GPS_TRACE_END();
+
+                jitter_record(&jitter, sent_ns - due * 1000000LL);
+                if (jitter.total % GPS_JITTER_LOG_INTERVAL == 0)
+                    jitter_log(&jitter);
             }
         }
 
-        close(client);
+        client = -1;
 
     }
 
     close(server);
+    if (local_server != -1)
+        close(local_server);
+    capture_close(&capture);
 
     return (server == -1 || client != -1);
 }
@@ -0,0 +1,56 @@
+#ifndef LOCAL_GPS_H_
+#define LOCAL_GPS_H_
+
+#include <stdint.h>
+
+/* path of the capture of simulator traffic, empty to disable it */
+#define GPS_CAPTURE_PROPERTY  "aic.gps.capture"
+
+/* number of decimals of the minutes in NMEA coordinates, [1..7] */
+#define GPS_NMEA_DECIMALS_PROPERTY  "aic.gps.nmea_decimals"
+#define GPS_DEFAULT_NMEA_DECIMALS   6
+
+/* noise model, see gps_noise.hpp. "1" enables it, the other values
+ * are "a,b" pairs, a missing seed picks a random one */
+#define GPS_NOISE_PROPERTY            "aic.gps.noise"
+#define GPS_NOISE_SEED_PROPERTY       "aic.gps.noise.seed"
+#define GPS_NOISE_WALK_PROPERTY       "aic.gps.noise.walk"       /* sigma m,tau s */
+#define GPS_NOISE_MULTIPATH_PROPERTY  "aic.gps.noise.multipath"  /* prob,m */
+#define GPS_NOISE_OUTAGE_PROPERTY     "aic.gps.noise.outage"     /* period s,duration s */
+
+/* Optional time of the fix in the simulator GPS payload: UTC milliseconds
+ * since the epoch, varint. The field is not in the libaicd schema yet, it
+ * is decoded from the wire so that simulators without it keep working. */
+#define GPS_PAYLOAD_TIME_FIELD  6
+
+/* "1" to also take simulator frames as UDP datagrams on SIM_GPS_PORT */
+#define GPS_UDP_PROPERTY  "aic.gps.udp"
+
+/* path of a ring of samples shared with a local producer, see gps_shm.hpp.
+ * When set, it replaces the simulator sockets */
+#define GPS_SHM_PROPERTY  "aic.gps.shm"
+
+/* low-jitter emission, see gps_realtime.hpp. "1" enables it, the CPU
+ * is left to the scheduler when empty */
+#define GPS_LOWJITTER_PROPERTY    "aic.gps.lowjitter"
+#define GPS_RT_PRIORITY_PROPERTY  "aic.gps.rt_priority"
+#define GPS_RT_CPU_PROPERTY       "aic.gps.rt_cpu"
+#define GPS_DEFAULT_RT_PRIORITY   10
+
+/* epochs between two logs of the emission jitter histogram */
+#define GPS_JITTER_LOG_INTERVAL   300
+
+/* Fix received from the simulator, coordinates are kept as integers
+ * (GPS_COORD_SCALE units per degree) from decoding to NMEA encoding */
+typedef struct {
+    int enabled;
+    int64_t latitude;
+    int64_t longitude;
+    double altitude;
+    double bearing;
+    int64_t time_ms;            /* UTC, 0 if the simulator sent none */
+    int64_t received_ms;        /* CLOCK_MONOTONIC at ingestion */
+    unsigned seq;               /* names the trace events of the fix */
+} gps_fix;
+
+#endif